@@ -4,7 +4,7 @@
 //  Created by John Holdsworth on 17/03/2022.
 //  Copyright © 2022 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/DeviceInjection.swift#44 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/DeviceInjection.swift#45 $
 //
 //  Code specific to injecting on an actual device.
 //
@@ -19,8 +19,10 @@ extension SwiftInjection {
 
     /// Emulate remaining functions of the dynamic linker.
     /// - Parameter pseudoImage: last image read into memory
+    /// - Parameter tmpfile: injection the image was built for
     public class func onDeviceSpecificProcessing(
-        for pseudoImage: MachImage, _ sweepClasses: [AnyClass]) {
+        for pseudoImage: MachImage, _ sweepClasses: [AnyClass],
+        tmpfile: String) {
         // register types, protocols, conformances...
         var section_size: UInt64 = 0
         for (section, regsiter) in [
@@ -39,7 +41,7 @@ extension SwiftInjection {
         // Redirect symbolic type references to main bundle
         reverse_symbolics(pseudoImage)
         // Initialise offsets to ivars
-        adjustIvarOffsets(in: pseudoImage)
+        adjustIvarOffsets(in: pseudoImage, tmpfile: tmpfile)
         // Fixup references to Objective-C classes
         fixupObjcClassReferences(in: pseudoImage)
         // Fix Objective-C messages to super
@@ -169,7 +171,8 @@ extension SwiftInjection {
         return swizzled
     }
 
-    public class func adjustIvarOffsets(in pseudoImage: MachImage) {
+    public class func adjustIvarOffsets(in pseudoImage: MachImage,
+                                        tmpfile: String) {
         var ivarOffsetPtr: UnsafeMutablePointer<ptrdiff_t>!
 
         // Objective-C source version
@@ -196,8 +199,8 @@ extension SwiftInjection {
         }
 
         // Swift source version
-        findHiddenSwiftSymbols(searchLastLoaded(), "Wvd", .any) {
-            (address, symname, _, _) -> Void in
+        for (address, symname) in SymbolIndex.of(tmpfile: tmpfile)
+            .symbols(withSuffix: "Wvd") {
             if let fieldInfo = SwiftMeta.demangle(symbol: symname),
                let (classname, ivarname): (String, String) =
                 fieldInfo[#"direct field offset for (\S+)\.\(?(\w+) "#],
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 08/03/2015.
 //  Copyright (c) 2015 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/FileWatcher.swift#49 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/FileWatcher.swift#51 $
 //
 //  Started out as an abstraction to watch files under a directory.
 //  "Enhanced" to extract the last modified build log directory by
@@ -41,10 +41,18 @@ public class FileWatcher: NSObject {
     var fileEvents: FSEventStreamRef! = nil
     var callback: InjectionCallback
     var context = FSEventStreamContext()
+    /// Report every path changed (including creations and
+    /// deletions) without filtering or backdating the stream.
+    var allFiles = false
+    /// Serial queue the stream is scheduled on rather than a run loop.
+    var queue: DispatchQueue?
 
     @objc public init(roots: [String], callback: @escaping InjectionCallback,
-                      runLoop: CFRunLoop? = nil) {
+                      runLoop: CFRunLoop? = nil, allFiles: Bool = false,
+                      queue: DispatchQueue? = nil) {
         self.callback = callback
+        self.allFiles = allFiles
+        self.queue = queue
         super.init()
         #if os(macOS)
         context.info = unsafeBitCast(self, to: UnsafeMutableRawPointer.self)
@@ -71,9 +79,10 @@ public class FileWatcher: NSObject {
                  // files in Xcode.
                  for i in 0 ..< numEvents {
                      let flag = Int(eventFlags[i])
-                     if (flag & (kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagItemModified)) != 0 {
+                     if watcher.allFiles || (flag & (kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagItemModified)) != 0 {
                         let changes = unsafeBitCast(eventPaths, to: NSArray.self)
-                         if CFRunLoopGetCurrent() != CFRunLoopGetMain() {
+                         if watcher.allFiles ||
+                             CFRunLoopGetCurrent() != CFRunLoopGetMain() {
                              return watcher.filesChanged(changes: changes)
                          }
                          DispatchQueue.main.async {
@@ -89,8 +98,12 @@ public class FileWatcher: NSObject {
         #if !os(macOS)
         watchers[fileEvents] = self
         #endif
-        FSEventStreamScheduleWithRunLoop(fileEvents, runLoop ?? CFRunLoopGetMain(),
-                                         "kCFRunLoopDefaultMode" as CFString)
+        if let queue = self.queue {
+            FSEventStreamSetDispatchQueue(fileEvents, queue)
+        } else {
+            FSEventStreamScheduleWithRunLoop(fileEvents, runLoop ?? CFRunLoopGetMain(),
+                                             "kCFRunLoopDefaultMode" as CFString)
+        }
         _ = FSEventStreamStart(fileEvents)
         self.fileEvents = fileEvents
         }
@@ -98,6 +111,9 @@ public class FileWatcher: NSObject {
     }
 
     func filesChanged(changes: NSArray) {
+        if allFiles {
+            return callback(changes, "")
+        }
         var changed = Set<String>()
         #if !INJECTION_III_APP
         let eventId = FSEventStreamGetLatestEventId(fileEvents)
@@ -144,6 +160,15 @@ public class FileWatcher: NSObject {
         }
     }
 
+    /// Deliver any events still pending due to the stream's latency.
+    /// Callbacks run on the stream's queue so this must be called off it.
+    func flush() {
+        if let queue = queue {
+            dispatchPrecondition(condition: .notOnQueue(queue))
+        }
+        FSEventStreamFlushSync(fileEvents)
+    }
+
     #if os(macOS)
     deinit {
         FSEventStreamStop(fileEvents)
@@ -186,8 +211,10 @@ typealias FSEventStreamCallback = @convention(c) (ConstFSEventStreamRef, UnsafeM
 let RTLD_DEFAULT = UnsafeMutableRawPointer(bitPattern: -2)
 let FSEventStreamCreate = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamCreate"), to: (@convention(c) (_ allocator: CFAllocator?, _ callback: FSEventStreamCallback, _ context: UnsafeMutableRawPointer?, _ pathsToWatch: CFArray, _ sinceWhen: FSEventStreamEventId, _ latency: CFTimeInterval, _ flags: FSEventStreamCreateFlags) -> FSEventStreamRef?)?.self)
 let FSEventStreamScheduleWithRunLoop = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamScheduleWithRunLoop"), to: (@convention(c) (_ streamRef: FSEventStreamRef, _ runLoop: CFRunLoop, _ runLoopMode: CFString) -> Void).self)
+let FSEventStreamSetDispatchQueue = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamSetDispatchQueue"), to: (@convention(c) (_ streamRef: FSEventStreamRef, _ queue: DispatchQueue?) -> Void).self)
 let FSEventStreamStart = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamStart"), to: (@convention(c) (_ streamRef: FSEventStreamRef) -> Bool).self)
 let FSEventStreamGetLatestEventId = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamGetLatestEventId"), to: (@convention(c) (_ streamRef: FSEventStreamRef) -> FSEventStreamEventId).self)
+let FSEventStreamFlushSync = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamFlushSync"), to: (@convention(c) (_ streamRef: FSEventStreamRef) -> Void).self)
 let FSEventStreamStop = unsafeBitCast(dlsym(RTLD_DEFAULT, "FSEventStreamStop"), to: (@convention(c) (_ streamRef: FSEventStreamRef) -> Void).self)
 #else
 @_silgen_name("FSEventStreamCreate")
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 02/24/2021.
 //  Copyright © 2021 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/InjectionClient.swift#91 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/InjectionClient.swift#99 $
 //
 //  Client app side of HotReloading started by +load
 //  method in HotReloadingGuts/ClientBoot.mm
@@ -38,6 +38,8 @@ public class InjectionClient: SimpleSocket, InjectionReader {
 
     let injectionQueue = isVapor ? DispatchQueue(label: "InjectionQueue") : .main
     var appVersion: String?
+    /// Server's tag for the result of the next load, inject or copy
+    var resultTag: String?
 
     open func log(_ msg: String) {
         print(APP_PREFIX+msg)
@@ -89,32 +91,15 @@ public class InjectionClient: SimpleSocket, InjectionReader {
             writeCommand(InjectionResponse.legacyUnhide.rawValue, with: "1")
         }
 
-        var frameworkPaths = [String: String]()
         let isPlugin = builder.tmpDir == "/tmp"
         if (!isPlugin) {
-            var frameworks = [String]()
-            var sysFrameworks = [String]()
-
-            for i in stride(from: _dyld_image_count()-1, through: 0, by: -1) {
-                guard let imageName = _dyld_get_image_name(i),
-                    strstr(imageName, ".framework/") != nil else {
-                    continue
-                }
-                let imagePath = String(cString: imageName)
-                let frameworkName = URL(fileURLWithPath: imagePath).lastPathComponent
-                frameworkPaths[frameworkName] = imagePath
-                if imagePath.hasPrefix(frameworksPath) {
-                    frameworks.append(frameworkName)
-                } else {
-                    sysFrameworks.append(frameworkName)
-                }
-            }
-
+            let metadata = HandshakeMetadata.load(executable: executable) ??
+                HandshakeMetadata(executable: executable,
+                                  frameworksPath: frameworksPath)
             writeCommand(InjectionResponse.frameworkList.rawValue, with:
-                frameworks.joined(separator: FRAMEWORK_DELIMITER))
-            write(sysFrameworks.joined(separator: FRAMEWORK_DELIMITER))
-            write(SwiftInjection.packageNames()
-                .joined(separator: FRAMEWORK_DELIMITER))
+                metadata.frameworks.joined(separator: FRAMEWORK_DELIMITER))
+            write(metadata.sysFrameworks.joined(separator: FRAMEWORK_DELIMITER))
+            write(metadata.packages.joined(separator: FRAMEWORK_DELIMITER))
         }
 
         var codesignStatusPipe = [Int32](repeating: 0, count: 2)
@@ -129,7 +114,7 @@ public class InjectionClient: SimpleSocket, InjectionReader {
             return reader.readString() == "1"
         }
 
-        SwiftTrace.swizzleFactory = SwiftTrace.LifetimeTracker.self
+        SwiftTrace.swizzleFactory = SwiftInjection.LatencyTracker.self
 
         if let projectRoot = getenv(INJECTION_PROJECT_ROOT) {
             writeCommand(InjectionResponse.projectRoot.rawValue,
@@ -178,7 +163,8 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                 writer.write(readString() ?? "0")
             case .traceFramework:
                 let frameworkName = readString() ?? "Misssing framework"
-                if let frameworkPath = frameworkPaths[frameworkName] {
+                if let frameworkPath = HandshakeMetadata
+                    .frameworkPaths[frameworkName] {
                     print("\(APP_PREFIX)Tracing %s\n", frameworkPath)
                     _ = SwiftTrace.interposeMethods(inBundlePath: frameworkPath,
                                                     packageName: nil)
@@ -280,7 +266,11 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                 \(APP_PREFIX)=================================================
                 """)
             SwiftInjection.dumpStats(top:top)
+            if let json = SwiftInjection.latencyStats(top: top) {
+                writeCommand(InjectionResponse.latencyStats.rawValue, with: json)
+            }
             needsTracing()
+            SwiftInjection.log(SwiftInjection.footprintSummary())
         case .callOrder:
             print("""
 
@@ -299,6 +289,12 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                 """)
             SwiftInjection.fileOrder()
             needsTracing()
+        case .footprint:
+            print("""
+                \(APP_PREFIX)Memory footprint of each injection
+                \(APP_PREFIX)==================================
+                """)
+            SwiftInjection.dumpFootprints()
         case .counts:
             print("""
                 \(APP_PREFIX)Counts of live objects by class:
@@ -311,6 +307,8 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                          with:SwiftInjection.callOrder().joined(separator: CALLORDER_DELIMITER))
             needsTracing()
         case .copy:
+            let tag = resultTag
+            resultTag = nil
             if let data = readData() {
                 injectionQueue.async {
                     var err: String?
@@ -322,6 +320,9 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                         self.log("⚠️ Injection error: \(error)")
                         err = "\(error)"
                     }
+                    if let tag = tag {
+                        self.writeCommand(InjectionResponse.tagged.rawValue, with: tag)
+                    }
                     let response: InjectionResponse = err != nil ? .error : .complete
                     self.writeCommand(response.rawValue, with: err)
                 }
@@ -346,6 +347,8 @@ public class InjectionClient: SimpleSocket, InjectionReader {
             if let xcodeDev = readString() {
                 builder.xcodeDev = xcodeDev
             }
+        case .tag:
+            resultTag = readString()
         case .appVersion:
             appVersion = readString()
             writeCommand(InjectionResponse.buildCache.rawValue,
@@ -364,6 +367,10 @@ public class InjectionClient: SimpleSocket, InjectionReader {
             log("⚠️ Could not read changed filename?")
             return
         }
+        let tag = command == .load || command == .inject ? resultTag : nil
+        if tag != nil {
+            resultTag = nil
+        }
         #if canImport(InjectionScratch)
         if command == .pseudoInject,
            let imagePointer = self.readPointer() {
@@ -447,6 +454,9 @@ public class InjectionClient: SimpleSocket, InjectionReader {
                 self.log("⚠️ Unimplemented command: #\(command.rawValue). " +
                          "Are you running the most recent versions?")
             }
+            if let tag = tag {
+                self.writeCommand(InjectionResponse.tagged.rawValue, with: tag)
+            }
             let response: InjectionResponse = err != nil ? .error : .complete
             self.writeCommand(response.rawValue, with: err)
         }
@@ -475,4 +485,84 @@ public class InjectionClient: SimpleSocket, InjectionReader {
         }
     }
 }
+
+/// Lists sent to the server on connecting. Finding the package names
+/// means demangling all the symbols of the executable so the lists are
+/// cached on disk for an executable with the same path, UUID and mtime.
+struct HandshakeMetadata: Codable {
+    var executable: String
+    var uuid: String
+    var mtime: TimeInterval
+    var frameworks = [String]()
+    var sysFrameworks = [String]()
+    var packages = [String]()
+
+    static var cacheFile: URL? {
+        return FileManager.default.urls(for: .cachesDirectory,
+                                        in: .userDomainMask).first?
+            .appendingPathComponent("HotReloading_\(Bundle.main.bundleIdentifier ?? "app").json")
+    }
+
+    /// Only needed when the server asks to trace a framework.
+    static var frameworkPaths: [String: String] = {
+        var frameworkPaths = [String: String]()
+        forEachFramework { frameworkPaths[$0] = $1 }
+        return frameworkPaths
+    }()
+
+    static func forEachFramework(_ callback: (String, String) -> Void) {
+        for i in stride(from: _dyld_image_count()-1, through: 0, by: -1) {
+            guard let imageName = _dyld_get_image_name(i),
+                strstr(imageName, ".framework/") != nil else {
+                continue
+            }
+            let imagePath = String(cString: imageName)
+            callback(URL(fileURLWithPath: imagePath).lastPathComponent, imagePath)
+        }
+    }
+
+    static func identity(of executable: String) -> (uuid: String, mtime: TimeInterval)? {
+        var info = stat()
+        guard stat(executable, &info) == 0 else { return nil }
+        let mtime = TimeInterval(info.st_mtimespec.tv_sec) +
+            TimeInterval(info.st_mtimespec.tv_nsec) / 1_000_000_000
+
+        guard let uuid = executable_uuid() else { return nil }
+        return (uuid, mtime)
+    }
+
+    static func load(executable: String) -> HandshakeMetadata? {
+        guard let cacheFile = cacheFile,
+              let (uuid, mtime) = identity(of: executable),
+              let data = try? Data(contentsOf: cacheFile),
+              let cached = try? JSONDecoder()
+                .decode(HandshakeMetadata.self, from: data),
+              cached.executable == executable && cached.uuid == uuid &&
+                cached.mtime == mtime else {
+            return nil
+        }
+        return cached
+    }
+
+    init(executable: String, frameworksPath: String) {
+        let (uuid, mtime) = Self.identity(of: executable) ?? ("", 0)
+        self.executable = executable
+        self.uuid = uuid
+        self.mtime = mtime
+
+        Self.forEachFramework { frameworkName, imagePath in
+            if imagePath.hasPrefix(frameworksPath) {
+                frameworks.append(frameworkName)
+            } else {
+                sysFrameworks.append(frameworkName)
+            }
+        }
+        packages = SwiftInjection.packageNames()
+
+        if uuid != "", let cacheFile = Self.cacheFile,
+           let data = try? JSONEncoder().encode(self) {
+            try? data.write(to: cacheFile)
+        }
+    }
+}
 #endif
@@ -4,18 +4,317 @@
 //  Created by John Holdsworth on 26/10/2022.
 //  Copyright © 2022 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/InjectionStats.swift#4 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/InjectionStats.swift#9 $
 //
 
 #if DEBUG || !SWIFT_PACKAGE
 import Foundation
 
+/// What loading an injection's dylib has cost in memory.
+public struct ImageFootprint {
+    let injectionNumber: Int
+    /// Virtual size of the dylib's segments
+    let mappedSize: UInt64
+    let newClasses: Int
+    /// Swift nominal type descriptors defined in the image
+    let typeDescriptors: Int
+    /// Change in resident memory over loading and patching
+    let residentDelta: Int64
+}
+
 extension SwiftInjection {
 
+    static var footprints = [ImageFootprint]()
+
+    public class func residentSize() -> UInt64 {
+        var info = mach_task_basic_info()
+        var count = mach_msg_type_number_t(MemoryLayout<mach_task_basic_info>
+            .size / MemoryLayout<natural_t>.size)
+        let status = withUnsafeMutablePointer(to: &info) {
+            $0.withMemoryRebound(to: integer_t.self, capacity: Int(count)) {
+                task_info(mach_task_self_,
+                          task_flavor_t(MACH_TASK_BASIC_INFO), $0, &count)
+            }
+        }
+        return status == KERN_SUCCESS ? info.resident_size : 0
+    }
+
+    class func mappedSize(of header: UnsafePointer<mach_header>) -> UInt64 {
+        var mapped: UInt64 = 0
+        var command = UnsafeRawPointer(header)
+            .advanced(by: MemoryLayout<mach_header_64>.size)
+        for _ in 0 ..< header.pointee.ncmds {
+            let load = command.assumingMemoryBound(to: load_command.self)
+            if load.pointee.cmd == UInt32(LC_SEGMENT_64) {
+                mapped += command.assumingMemoryBound(
+                    to: segment_command_64.self).pointee.vmsize
+            }
+            command = command.advanced(by: Int(load.pointee.cmdsize))
+        }
+        return mapped
+    }
+
+    /// Header of the most recently loaded image with a path.
+    class func imageHeader(named path: UnsafePointer<Int8>)
+        -> UnsafePointer<mach_header>? {
+        for image in (0 ..< _dyld_image_count()).reversed() {
+            if let name = _dyld_get_image_name(image), strcmp(name, path) == 0 {
+                return _dyld_get_image_header(image)
+            }
+        }
+        return nil
+    }
+
+    class func recordFootprint(newClasses: [AnyClass], residentBefore: UInt64,
+                               tmpfile: String) {
+        let lastLoaded = searchLastLoaded()
+        let typeDescriptors = SymbolIndex.of(tmpfile: tmpfile)
+            .symbols(withSuffix: "Mn").count
+        footprints.append(ImageFootprint(
+            injectionNumber: SwiftEval.instance.injectionNumber,
+            mappedSize: imageHeader(named: lastLoaded)
+                .map { mappedSize(of: $0) } ?? 0,
+            newClasses: newClasses.count, typeDescriptors: typeDescriptors,
+            residentDelta: Int64(bitPattern: residentSize() &- residentBefore)))
+    }
+
+    @objc public class func dumpFootprints() {
+        let MB = 1024.0 * 1024.0
+        for footprint in footprints {
+            print(String(format: "#%d\t%.2fMB mapped\t%d classes\t" +
+                         "%d types\t%+.2fMB resident",
+                         footprint.injectionNumber,
+                         Double(footprint.mappedSize) / MB,
+                         footprint.newClasses, footprint.typeDescriptors,
+                         Double(footprint.residentDelta) / MB))
+        }
+        log(footprintSummary())
+    }
+
+    public class func footprintSummary() -> String {
+        let MB = 1024.0 * 1024.0
+        let mapped = footprints.reduce(0) { $0 + $1.mappedSize }
+        let resident = footprints.reduce(0) { $0 + $1.residentDelta }
+        let classes = footprints.reduce(0) { $0 + $1.newClasses }
+        return String(format: "%d injections loaded: %.2fMB mapped, " +
+                      "%d classes, %+.2fMB resident (now %.1fMB)",
+                      footprints.count, Double(mapped) / MB, classes,
+                      Double(resident) / MB, Double(residentSize()) / MB)
+    }
+
     @objc public class func dumpStats(top: Int) {
-        let invocationCounts =  SwiftTrace.invocationCounts()
-        for (method, elapsed) in SwiftTrace.sortedElapsedTimes(onlyFirst: top) {
-            print("\(String(format: "%.1f", elapsed*1000.0))ms/\(invocationCounts[method] ?? 0)\t\(method)")
+        let latencies = topLatencies(top)
+        guard !latencies.isEmpty else {
+            let invocationCounts =  SwiftTrace.invocationCounts()
+            for (method, elapsed) in SwiftTrace.sortedElapsedTimes(onlyFirst: top) {
+                print("\(String(format: "%.1f", elapsed*1000.0))ms/\(invocationCounts[method] ?? 0)\t\(method)")
+            }
+            return
+        }
+        print("total/calls\tp50\tp95\tp99\tmax (ms)")
+        for histogram in latencies {
+            print(String(format: "%.1fms/%d\t%.3f\t%.3f\t%.3f\t%.3f\t",
+                         histogram.total/1000.0, histogram.count,
+                         histogram.percentile(50)/1000.0,
+                         histogram.percentile(95)/1000.0,
+                         histogram.percentile(99)/1000.0,
+                         histogram.max/1000.0)+histogram.signature)
+        }
+    }
+
+    /// Latency distributions of the top methods as JSON.
+    public class func latencyStats(top: Int) -> String? {
+        let methods = topLatencies(top).map { histogram -> [String: Any] in
+            return ["method": histogram.signature,
+                    "count": histogram.count,
+                    "totalMs": histogram.total/1000.0,
+                    "p50Ms": histogram.percentile(50)/1000.0,
+                    "p95Ms": histogram.percentile(95)/1000.0,
+                    "p99Ms": histogram.percentile(99)/1000.0,
+                    "maxMs": histogram.max/1000.0]
+        }
+        guard !methods.isEmpty, let json = try? JSONSerialization
+                .data(withJSONObject: methods, options: [.prettyPrinted]) else {
+            return nil
+        }
+        return String(data: json, encoding: .utf8)
+    }
+
+    /// Log-bucketed distribution of a traced method's durations (µs).
+    public final class LatencyHistogram {
+        static let bucketsPerOctave = 4.0, bucketCount = 128
+
+        let signature: String
+        var buckets = [UInt32](repeating: 0, count: bucketCount)
+        var count = 0, total = 0.0, max = 0.0
+
+        init(signature: String) {
+            self.signature = signature
+        }
+
+        static func bucket(for usec: Double) -> Int {
+            return Swift.min(bucketCount-1, Swift.max(0,
+                Int(log2(Swift.max(usec, 1.0)) * bucketsPerOctave)))
+        }
+
+        func record(_ usec: Double) {
+            buckets[Self.bucket(for: usec)] += 1
+            count += 1
+            total += usec
+            max = Swift.max(max, usec)
+        }
+
+        func merge(_ other: LatencyHistogram) {
+            for bucket in 0 ..< Self.bucketCount {
+                buckets[bucket] += other.buckets[bucket]
+            }
+            count += other.count
+            total += other.total
+            max = Swift.max(max, other.max)
+        }
+
+        /// Upper bound of the bucket containing the percentile.
+        func percentile(_ percent: Double) -> Double {
+            let rank = Swift.max(1, Int((Double(count) * percent / 100.0)
+                                    .rounded(.up)))
+            var seen = 0
+            for (bucket, inBucket) in buckets.enumerated() {
+                seen += Int(inBucket)
+                if seen >= rank {
+                    return Swift.min(max, pow(2.0,
+                        Double(bucket+1) / Self.bucketsPerOctave))
+                }
+            }
+            return max
+        }
+    }
+
+    /// Histograms recorded on a thread. The lock is only
+    /// ever contended while the histograms are being merged.
+    final class ThreadLatencies {
+        let lock = NSLock()
+        var histograms = [ObjectIdentifier: LatencyHistogram]()
+    }
+
+    static let latencyKey: pthread_key_t = {
+        var key = pthread_key_t()
+        pthread_key_create(&key) { buffer in
+            SwiftInjection.retire(Unmanaged<ThreadLatencies>
+                .fromOpaque(buffer).takeUnretainedValue())
+        }
+        return key
+    }()
+    static let registryLock = NSLock()
+    /// Retains the buffers of live threads that have recorded
+    static var threadLatencies = [ThreadLatencies]()
+    /// Histograms of threads that have exited by signature
+    static var retiredLatencies = [String: LatencyHistogram]()
+
+    static func merge<S: Sequence>(_ histograms: S,
+        into merged: inout [String: LatencyHistogram])
+        where S.Element == LatencyHistogram {
+        for histogram in histograms {
+            if merged[histogram.signature] == nil {
+                merged[histogram.signature] =
+                    LatencyHistogram(signature: histogram.signature)
+            }
+            merged[histogram.signature]!.merge(histogram)
+        }
+    }
+
+    /// Fold the buffer of an exiting thread into the retired
+    /// histograms and release it.
+    static func retire(_ buffer: ThreadLatencies) {
+        registryLock.lock()
+        defer { registryLock.unlock() }
+        threadLatencies.removeAll(where: { $0 === buffer })
+        buffer.lock.lock()
+        merge(buffer.histograms.values, into: &retiredLatencies)
+        buffer.lock.unlock()
+    }
+
+    static func threadBuffer() -> ThreadLatencies {
+        if let existing = pthread_getspecific(latencyKey) {
+            return Unmanaged<ThreadLatencies>
+                .fromOpaque(existing).takeUnretainedValue()
+        }
+        let buffer = ThreadLatencies()
+        registryLock.lock()
+        threadLatencies.append(buffer)
+        registryLock.unlock()
+        pthread_setspecific(latencyKey,
+                            Unmanaged.passUnretained(buffer).toOpaque())
+        return buffer
+    }
+
+    public class func recordLatency(_ usec: Double, of swizzle: SwiftTrace.Swizzle) {
+        let buffer = threadBuffer(), id = ObjectIdentifier(swizzle)
+        buffer.lock.lock()
+        if let histogram = buffer.histograms[id] {
+            histogram.record(usec)
+        } else {
+            let histogram = LatencyHistogram(signature: swizzle.signature)
+            histogram.record(usec)
+            buffer.histograms[id] = histogram
+        }
+        buffer.lock.unlock()
+    }
+
+    public class func mergedLatencies() -> [LatencyHistogram] {
+        registryLock.lock()
+        defer { registryLock.unlock() }
+
+        var merged = [String: LatencyHistogram]()
+        merge(retiredLatencies.values, into: &merged)
+        for buffer in threadLatencies {
+            buffer.lock.lock()
+            merge(buffer.histograms.values, into: &merged)
+            buffer.lock.unlock()
+        }
+        return Array(merged.values)
+    }
+
+    /// Methods with the largest total time, most expensive first, selected
+    /// using a min-heap of size n rather than sorting all the methods.
+    public class func topLatencies(_ n: Int) -> [LatencyHistogram] {
+        var heap = [LatencyHistogram]()
+        func siftDown(_ from: Int) {
+            var parent = from
+            while true {
+                var smallest = parent
+                for child in [2*parent+1, 2*parent+2] where child < heap.count &&
+                    heap[child].total < heap[smallest].total {
+                    smallest = child
+                }
+                if smallest == parent { return }
+                heap.swapAt(parent, smallest)
+                parent = smallest
+            }
+        }
+        for histogram in mergedLatencies() where n > 0 {
+            if heap.count < n {
+                heap.append(histogram)
+                var child = heap.count-1
+                while child > 0 && heap[child].total < heap[(child-1)/2].total {
+                    heap.swapAt(child, (child-1)/2)
+                    child = (child-1)/2
+                }
+            } else if histogram.total > heap[0].total {
+                heap[0] = histogram
+                siftDown(0)
+            }
+        }
+        return heap.sorted { $0.total > $1.total }
+    }
+
+    /// Swizzle that also records the duration of each
+    /// invocation in a latency histogram for its method.
+    open class LatencyTracker: SwiftTrace.LifetimeTracker {
+        open override func onExit(stack: inout SwiftTrace.ExitStack,
+                                  invocation: Invocation) {
+            super.onExit(stack: &stack, invocation: invocation)
+            SwiftInjection.recordLatency(Invocation.usecTime() -
+                                         invocation.timeEntered, of: self)
         }
     }
 
@@ -4,7 +4,7 @@
 //  Created by John Holdsworth on 09/06/2022.
 //  Copyright © 2022 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/ReducerInjection.swift#12 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/ReducerInjection.swift#14 $
 //
 //  Support for injecting "The Composble Architecture" Reducers using TCA fork:
 //  https://github.com/thebrowsercompany/swift-composable-architecture/tree/develop
@@ -49,8 +49,11 @@ extension SwiftInjection {
     public class func reinitializeInjectedReducers(_ tmpfile: String,
         reinitialized: UnsafeMutablePointer<[SymbolName]>) {
         _ = checkReducerInitializers
-        findHiddenSwiftSymbols(searchLastLoaded(), "_WZ", .local) {
-            accessor, symname, _, _ in
+        // only one-time initialisers are checked against registered reducers.
+        // The index includes non-local symbols as well, as did the .any scan
+        // of checkReducerInitializers, but only registered names are run.
+        for (accessor, symname) in SymbolIndex.of(tmpfile: tmpfile)
+            .symbols(withSuffix: "_WZ") {
             if injectableReducerSymbols.contains(String(cString: symname)) {
                 typealias OneTimeInitialiser = @convention(c) () -> Void
                 let reinitialise: OneTimeInitialiser = autoBitCast(accessor)
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 02/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftEval.swift#302 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftEval.swift#312 $
 //
 //  Basic implementation of a Swift "eval()" including the
 //  mechanics of recompiling a class and loading the new
@@ -309,23 +309,13 @@ public class SwiftEval: NSObject {
     }
 
     public func actualCase(path: String) -> String? {
-        let fm = FileManager.default
-        if fm.fileExists(atPath: path) {
+        if FileManager.default.fileExists(atPath: path) {
             return path
         }
         var out = ""
         for component in path.split(separator: "/") {
-            var real: String?
-            if fm.fileExists(atPath: out+"/"+component) {
-                real = String(component)
-            } else {
-                guard let contents = try? fm.contentsOfDirectory(atPath: "/"+out) else {
-                    return nil
-                }
-                real = contents.first { $0.lowercased() == component.lowercased() }
-            }
-
-            guard let found = real else {
+            guard let found = Self.directoryCache.entry(
+                named: String(component), in: out.isEmpty ? "/" : out) else {
                 return nil
             }
             out += "/" + found
@@ -333,6 +323,55 @@ public class SwiftEval: NSObject {
         return out
     }
 
+    /// Listings shared by all builders for actualCase(path:)
+    static let directoryCache = DirectoryCache()
+    /// Compile commands with paths mapped to their actual case
+    var normalisedCommands = [String: String]()
+
+    /// Case-folded directory listings so mapping the paths of a compile
+    /// command to their actual case lists each directory only once.
+    public class DirectoryCache {
+        /// Directory -> lowercased name -> names on disk
+        var listings = [String: [String: [String]]]()
+        let lock = NSLock()
+
+        func listing(of directory: String, refresh: Bool) -> [String: [String]] {
+            if !refresh, let listing = listings[directory] {
+                return listing
+            }
+            var listing = [String: [String]]()
+            for name in (try? FileManager.default
+                .contentsOfDirectory(atPath: directory)) ?? [] {
+                listing[name.lowercased(), default: []].append(name)
+            }
+            listings[directory] = listing
+            return listing
+        }
+
+        /// Name in directory exactly or differing only in case. A name
+        /// not found in a cached listing re-lists the directory once.
+        public func entry(named name: String, in directory: String) -> String? {
+            lock.lock()
+            defer { lock.unlock() }
+            let folded = name.lowercased()
+            for refresh in [false, true] {
+                if let names = listing(of: directory, refresh: refresh)[folded] {
+                    return names.contains(name) ? name : names.first
+                }
+                if listings[directory] == nil {
+                    break
+                }
+            }
+            return nil
+        }
+
+        public func invalidate() {
+            lock.lock()
+            listings.removeAll()
+            lock.unlock()
+        }
+    }
+
     let detectFilepaths = try! NSRegularExpression(pattern: #"(/(?:[^\ ]*\\.)*[^\ ]*) "#)
 
     @objc public func rebuildClass(oldClass: AnyClass?,
@@ -345,6 +384,11 @@ public class SwiftEval: NSObject {
         // locate compile command for class
 
         injectionNumber += 1
+        stepTimings.removeAll()
+        defer {
+            reportTimings()
+            collectArtifacts()
+        }
 
         if projectFile.lastPathComponent == bazelWorkspace,
             let dylib = try bazelLight(projectRoot: projectRoot,
@@ -382,22 +426,30 @@ public class SwiftEval: NSObject {
         #if targetEnvironment(simulator)
         // Normalise paths in compile command with the actual casing
         // of files as the simulator has a case-sensitive file system.
-        for filepath in detectFilepaths.matches(in: compileCommand, options: [],
-            range: NSMakeRange(0, compileCommand.utf16.count))
-            .compactMap({ compileCommand[$0.range(at: 1)] }) {
-            let unescaped = filepath.unescape()
-            if let normalised = actualCase(path: unescaped) {
-                let escaped = normalised.escaping("' ${}()&*~")
-                if filepath != escaped {
-                    print("""
-                            \(APP_PREFIX)Mapped: \(filepath)
-                            \(APP_PREFIX)... to: \(escaped)
-                            """)
-                    compileCommand = compileCommand
-                        .replacingOccurrences(of: filepath, with: escaped,
-                                              options: .caseInsensitive)
+        if let normalised = normalisedCommands[compileCommand] {
+            compileCommand = normalised
+        } else {
+            let original = compileCommand
+            timed("normalise") {
+                for filepath in detectFilepaths.matches(in: compileCommand, options: [],
+                    range: NSMakeRange(0, compileCommand.utf16.count))
+                    .compactMap({ compileCommand[$0.range(at: 1)] }) {
+                    let unescaped = filepath.unescape()
+                    if let normalised = actualCase(path: unescaped) {
+                        let escaped = normalised.escaping("' ${}()&*~")
+                        if filepath != escaped {
+                            print("""
+                                    \(APP_PREFIX)Mapped: \(filepath)
+                                    \(APP_PREFIX)... to: \(escaped)
+                                    """)
+                            compileCommand = compileCommand
+                                .replacingOccurrences(of: filepath, with: escaped,
+                                                      options: .caseInsensitive)
+                        }
+                    }
                 }
             }
+            normalisedCommands[original] = compileCommand
         }
         #endif
 
@@ -452,10 +504,14 @@ public class SwiftEval: NSObject {
         }
 
         debug("Final command:", compileCommand, "-->", objectFile)
-        guard shell(command: """
+        guard timed("compile", { shell(command: """
                 (cd "\(projectRoot.escaping("$"))" && \
                 \(compileCommand) >\"\(logfile)\" 2>&1)
-                """) || isBazelCompile else {
+                """) }) || isBazelCompile else {
+            // superseded, the compile command is not at fault
+            if isCancelled {
+                throw evalError("Compilation of \(sourceFile) cancelled")
+            }
             if longTermCache[classNameOrFile] != nil {
                 updateLongTermCache(remove: classNameOrFile)
                 do {
@@ -501,14 +557,15 @@ public class SwiftEval: NSObject {
         // link resulting object file to create dynamic library
         _ = objectUnhider?(objectFile)
 
-        var speclib = ""
+        var speclibs = [String]()
         if sourceFile.contains("Spec.") && (try? String(
             contentsOfFile: classNameOrFile))?.contains("Quick") == true {
-            speclib = logsDir.path+"/../../Build/Products/"+Self.quickFiles
+            speclibs = Self.expand(pattern: logsDir.path +
+                                   "/../../Build/Products/"+Self.quickFiles)
         }
 
         try link(dylib: "\(tmpfile).dylib", compileCommand: compileCommand,
-                 contents: "\"\(objectFile)\" \(speclib)")
+                 objects: [objectFile] + speclibs)
         return tmpfile
     }
 
@@ -523,6 +580,99 @@ public class SwiftEval: NSObject {
                             atomically: false)
     }
 
+    /// Budget for files left behind in tmpDir and /tmp/filelists
+    /// by rebuilds of previous sessions before they are pruned.
+    static var artifactBudget = (bytes: 256 * 1024 * 1024,
+                                 age: TimeInterval(24 * 60 * 60))
+    static let artifactPattern = try! NSRegularExpression(
+        pattern: #"^eval[\d_]+\.(dylib|log|sh|pl|err|files)$"#)
+    static let collectorQueue = DispatchQueue(label: "SwiftEvalCollector",
+                                              qos: .utility)
+    /// Start of the process rather than of first use as static
+    /// lets are initialised lazily, after artifacts are loaded.
+    static let sessionStarted: Date = {
+        var info = kinfo_proc(), size = MemoryLayout<kinfo_proc>.size
+        var mib = [CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid()]
+        guard sysctl(&mib, u_int(mib.count), &info, &size, nil, 0) == 0 else {
+            return Date(timeIntervalSinceNow: -ProcessInfo.processInfo.systemUptime)
+        }
+        let started = info.kp_proc.p_un.__p_starttime
+        return Date(timeIntervalSince1970: TimeInterval(started.tv_sec) +
+                        TimeInterval(started.tv_usec) / 1_000_000)
+    }()
+    static var lastCollected = Date.distantPast
+    static let collectedLock = NSLock()
+
+    /// Prune stale artifacts of injections in the background, keeping any
+    /// from this session (which may be loaded) and file lists referenced
+    /// by compile commands in the long term cache of any platform.
+    func collectArtifacts() {
+        Self.collectedLock.lock()
+        guard Date().timeIntervalSince(Self.lastCollected) > 60 else {
+            Self.collectedLock.unlock()
+            return
+        }
+        Self.lastCollected = Date()
+        Self.collectedLock.unlock()
+
+        let cached = longTermCache.allValues.compactMap { $0 as? String }
+        let tmpDir = self.tmpDir, budget = Self.artifactBudget,
+            buildCacheFile = self.buildCacheFile
+        Self.collectorQueue.async {
+            let fileManager = FileManager.default
+            var commands = cached
+            // /tmp/filelists is shared by the builds of all platforms
+            for file in (try? fileManager.contentsOfDirectory(atPath: "/tmp")) ?? []
+                where file.hasSuffix("_builds.plist") &&
+                    "/tmp/"+file != buildCacheFile {
+                commands += (NSDictionary(contentsOfFile: "/tmp/"+file)?
+                    .allValues ?? []).compactMap { $0 as? String }
+            }
+            var referenced = Set<String>()
+            let filelistRegex = try! NSRegularExpression(
+                pattern: #"/tmp/filelists/[^\s"']+"#)
+            for command in commands {
+                for match in filelistRegex.matches(in: command, range:
+                    NSRange(command.startIndex..., in: command)) {
+                    if let range = Range(match.range, in: command) {
+                        referenced.insert(String(command[range]).unescape())
+                    }
+                }
+            }
+
+            var candidates = [(path: String, size: Int, modified: Date)]()
+            for (directory, pattern) in [(tmpDir, Self.artifactPattern),
+                                         ("/tmp/filelists", nil)] {
+                for file in (try? fileManager
+                    .contentsOfDirectory(atPath: directory)) ?? [] {
+                    let path = directory+"/"+file
+                    guard pattern?.firstMatch(in: file, range: NSRange(
+                            file.startIndex..., in: file)) != nil ||
+                            pattern == nil, !referenced.contains(path),
+                          let attrs = try? fileManager.attributesOfItem(atPath: path),
+                          let modified = attrs[.modificationDate] as? Date,
+                          modified < Self.sessionStarted else {
+                        continue
+                    }
+                    candidates.append((path, (attrs[.size] as? Int) ?? 0, modified))
+                }
+            }
+
+            var total = candidates.reduce(0) { $0 + $1.size }, pruned = 0
+            let expired = Date(timeIntervalSinceNow: -budget.age)
+            for candidate in candidates.sorted(by: { $0.modified < $1.modified })
+                where total > budget.bytes || candidate.modified < expired {
+                if (try? fileManager.removeItem(atPath: candidate.path)) != nil {
+                    total -= candidate.size
+                    pruned += 1
+                }
+            }
+            if pruned != 0 {
+                debug("Pruned \(pruned) artifacts, \(total) bytes remain")
+            }
+        }
+    }
+
     // Implementations provided in UnhidingEval.swift
     func bazelLight(projectRoot: String, recompile sourceFile: String) throws -> String? {
         throw evalError("No bazel support")
@@ -540,7 +690,7 @@ public class SwiftEval: NSObject {
     static let parsePlatform = try! NSRegularExpression(pattern:
         #"-(?:isysroot|sdk)(?: |"\n")((\#(fileNameRegex)/Contents/Developer)/Platforms/(\w+)\.platform\#(fileNameRegex)\#\.sdk)"#)
 
-    func link(dylib: String, compileCommand: String, contents: String,
+    func link(dylib: String, compileCommand: String, objects: [String],
               cd: String = "") throws {
         var platform: String
         switch buildCacheFile {
@@ -594,19 +744,42 @@ public class SwiftEval: NSObject {
         }
 
         let toolchain = xcodeDev+"/Toolchains/XcodeDefault.xctoolchain"
-        let cd = cd == "" ? "" : "cd \"\(cd)\" && "
-        if cd != "" && !contents.contains(arch) {
-            _ = evalError("Modified object files \(contents) not built for architecture \(arch)")
+        if cd != "" && !objects.joined(separator: " ").contains(arch) {
+            _ = evalError("Modified object files \(objects) not built for architecture \(arch)")
         }
-        guard shell(command: """
-            \(cd)"\(toolchain)/usr/bin/clang" -arch "\(arch)" \
-                -Xlinker -dylib -isysroot "__PLATFORM__" \
-                -L"\(toolchain)/usr/lib/swift/\(platform.lowercased())" \(osSpecific) \
-                -undefined dynamic_lookup -dead_strip -Xlinker -objc_abi_version \
-                -Xlinker 2 -Xlinker -interposable\(linkerOptions) -fobjc-arc \
-                -fprofile-instr-generate \(contents) -L "\(frameworks)" -F "\(frameworks)" \
-                -rpath "\(frameworks)" -o \"\(dylib)\" >>\"\(logfile)\" 2>&1
-            """.replacingOccurrences(of: "__PLATFORM__", with: sdk)) else {
+
+        // Frameworks are found relative to the executable loading the
+        // dylib so one build can be loaded into any app of the platform.
+        let rpath = platform == "MacOSX" ? "@executable_path/../Frameworks" :
+            "@executable_path/Frameworks"
+        // Options that don't change between injections are kept in a
+        // response file named for its contents as clients can share tmpDir.
+        let options = ["-arch", arch, "-Xlinker", "-dylib", "-isysroot", sdk,
+            "-L\(toolchain)/usr/lib/swift/\(platform.lowercased())"] +
+            Self.split(osSpecific) + ["-undefined", "dynamic_lookup",
+            "-dead_strip", "-Xlinker", "-objc_abi_version", "-Xlinker", "2",
+            "-Xlinker", "-interposable"] + Self.split(linkerOptions) +
+            ["-fobjc-arc", "-fprofile-instr-generate", "-L", frameworks,
+             "-F", frameworks, "-rpath", rpath]
+        let responses = options.map { "\"\($0.escaping(#""\\"#))\"" }
+            .joined(separator: "\n")
+        let digest = responses.utf8.reduce(UInt64(14695981039346656037)) {
+            ($0 ^ UInt64($1)) &* 1099511628211 } // FNV-1a
+        let responseFile = "\(tmpDir)/link_\(platform)_\(arch)_" +
+            String(digest, radix: 16) + ".rsp"
+        if !linkResponses.contains(responseFile) ||
+            !FileManager.default.fileExists(atPath: responseFile) {
+            do {
+                try responses.write(toFile: responseFile,
+                                    atomically: true, encoding: .utf8)
+                linkResponses.insert(responseFile)
+            } catch {
+                throw evalError("Could not write response file: \(error)")
+            }
+        }
+
+        guard timed("link", { exec(["\(toolchain)/usr/bin/clang",
+                    "@"+responseFile] + objects + ["-o", dylib], cd: cd) }) else {
             throw scriptError("Linking")
         }
 
@@ -615,7 +788,7 @@ public class SwiftEval: NSObject {
         if signer != nil {
             guard dylib.hasSuffix(Self.quickDylib) ||
                 buildCacheFile == Self.simulatorCacheFile ||
-                signer!("\(injectionNumber).dylib") else {
+                timed("codesign", { signer!("\(injectionNumber).dylib") }) else {
                 #if SWIFT_PACKAGE
                 throw evalError("Codesign failed. Consult /tmp/hot_reloading.log or Console.app")
                 #else
@@ -630,21 +803,39 @@ public class SwiftEval: NSObject {
                 throw evalError("Codesign failed. Is 'signer' daemon running?")
             }
             #else
-            guard shell(command: """
-                export CODESIGN_ALLOCATE=\(xcodeDev)/Toolchains/XcodeDefault.xctoolchain/usr/bin/codesign_allocate; codesign --force -s '-' "\(tmpfile).dylib"
-                """) else {
+            guard timed("codesign", { exec(["/usr/bin/codesign", "--force",
+                "-s", "-", "\(tmpfile).dylib"], environment: ["CODESIGN_ALLOCATE":
+                "\(toolchain)/usr/bin/codesign_allocate"]) }) else {
                 throw evalError("Codesign failed")
             }
             #endif
         }
 
-        // Rewrite dylib to prevent macOS 10.15+ from quarantining it
-        let url = URL(fileURLWithPath: dylib)
-        let dylib = try Data(contentsOf: url)
-        try FileManager.default.removeItem(at: url)
-        try dylib.write(to: url)
+        // Prevent macOS 10.15+ from quarantining the dylib
+        if removexattr(dylib, "com.apple.quarantine", 0) != 0 && errno != ENOATTR {
+            debug("Could not remove quarantine: \(String(cString: strerror(errno)))")
+        }
+    }
+
+    /// Link response files already written by this builder.
+    var linkResponses = Set<String>()
+
+    /// Split option string into separate arguments.
+    static func split(_ options: String) -> [String] {
+        return options.components(separatedBy: " ").filter { !$0.isEmpty }
     }
 
+    /// Expand wildcards in a path as the shell would have.
+    static func expand(pattern: String) -> [String] {
+        var matches = glob_t()
+        defer { globfree(&matches) }
+        guard glob(pattern, GLOB_BRACE|GLOB_NOCHECK, nil, &matches) == 0 else {
+            return []
+        }
+        return (0 ..< Int(matches.gl_pathc)).compactMap {
+            matches.gl_pathv[$0].flatMap { String(cString: $0) }
+        }
+    }
 
     /// Regex for path argument, perhaps containg escaped spaces
     static let argumentRegex = #"[^\s\\]*(?:\\.[^\s\\]*)*"#
@@ -854,6 +1045,8 @@ public class SwiftEval: NSObject {
 
     func findCompileCommand(logsDir: URL, classNameOrFile: String, tmpfile: String)
         throws -> (compileCommand: String, sourceFile: String)? {
+        // a build may have added files since directories were listed
+        Self.directoryCache.invalidate()
         // path to project can contain spaces and '$&(){}
         // Objective-C paths can only contain space and '
         // project file itself can only contain spaces
@@ -872,18 +1065,23 @@ public class SwiftEval: NSObject {
             " and $line !~ / -module-name App /" : ""
         #if targetEnvironment(simulator)
         let actualPath = #"""
+                return $_[0] if -e $_[0];
                 my $out = "/";
 
                 for my $name (split "/", $_[0]) {
                     my $next = "$out/$name";
-                    if (! -f $next) {
-                        opendir my $dh, $out;
-                        while (my $entry = readdir $dh) {
-                            if (uc $name eq uc $entry) {
-                                $next = "$out/$entry";
-                                last;
+                    if (! -e $next) {
+                        # case-folded listing of each directory read once
+                        if (!$listings{$out}) {
+                            my %listing;
+                            opendir my $dh, $out;
+                            while (my $entry = readdir $dh) {
+                                $listing{uc $entry} ||= $entry;
                             }
+                            $listings{$out} = \%listing;
                         }
+                        my $entry = $listings{$out}{uc $name};
+                        $next = "$out/$entry" if defined $entry;
                     }
                     $out = $next;
                 }
@@ -914,6 +1112,7 @@ public class SwiftEval: NSObject {
                     # format is gzip
                     open GUNZIP, "/usr/bin/gunzip <\"$ARGV[0]\" 2>/dev/null |" or die "gnozip";
 
+                    my %listings;
                     sub actualPath {
                     \#(actualPath)
                     }
@@ -1006,7 +1205,7 @@ public class SwiftEval: NSObject {
                     """#.write(toFile: "\(tmpfile).pl",
                                atomically: false, encoding: .utf8)
 
-        guard shell(command: """
+        guard timed("log scan", { shell(command: """
             # search through build logs, most recent first
             cp \(cmdfile) \(cmdfile).save 2>/dev/null ; \
             cd "\(logsDir.path.escaping("$"))" &&
@@ -1016,7 +1215,7 @@ public class SwiftEval: NSObject {
                 >"\(tmpfile).sh" 2>>"\(tmpfile).err" && exit 0
             done
             exit 1;
-            """) else {
+            """) }) else {
             #if targetEnvironment(simulator)
             if #available(iOS 14.0, tvOS 14.0, *) {
             } else {
@@ -1226,84 +1425,238 @@ public class SwiftEval: NSObject {
         try! command.write(toFile: cmdfile, atomically: false, encoding: .utf8)
         debug(command)
 
+        guard let runner = runner ?? ScriptRunner() else {
+            return false
+        }
+        self.runner = runner
+        guard running(group: runner.pid) else {
+            return false
+        }
+        defer { _ = running(group: 0) }
+        if let status = runner.run(script: cmdfile) {
+            return status == EXIT_SUCCESS
+        }
+        self.runner = nil // worker has exited, restart next time
+        return false
+    }
+
+    /// Process group of the script or tool being run, 0 if none.
+    var runningGroup: pid_t = 0
+    /// Set by cancel() so the remaining steps of a rebuild fail
+    var cancelled = false
+    let runningLock = NSLock()
+
+    var isCancelled: Bool {
+        runningLock.lock()
+        defer { runningLock.unlock() }
+        return cancelled
+    }
+
+    /// Interrupt the rebuild in progress, killing the process group
+    /// of the script or tool it is running (and their children).
+    /// Further steps fail until uncancel() is called.
+    public func cancel() {
+        runningLock.lock()
+        defer { runningLock.unlock() }
+        cancelled = true
+        if runningGroup != 0 {
+            kill(-runningGroup, SIGTERM)
+        }
+    }
+
+    public func uncancel() {
+        runningLock.lock()
+        cancelled = false
+        runningLock.unlock()
+    }
+
+    /// Record the process group being run.
+    /// - Returns: false if the rebuild has been cancelled
+    func running(group: pid_t) -> Bool {
+        runningLock.lock()
+        defer { runningLock.unlock() }
+        runningGroup = cancelled ? 0 : group
+        return !cancelled
+    }
+
+    /// Environment for processes run on behalf of the client/daemon.
+    static var toolEnvironment: [String: String] = {
         #if os(macOS)
-        let task = Process()
-        task.launchPath = "/bin/bash"
-        task.arguments = [cmdfile]
-        task.launch()
-        task.waitUntilExit()
-        let status = task.terminationStatus
+        return ProcessInfo.processInfo.environment
         #else
-        let status = runner.run(script: cmdfile)
+        // simulator environment is not suitable for macOS binaries
+        return getenv("USER_HOME").flatMap {
+            ["HOME": String(cString: $0)] } ?? [:]
         #endif
+    }()
+
+    /// Run a toolchain binary directly, without going through a shell,
+    /// with output appended to the logfile. Taking arguments as a vector
+    /// there is no quoting or escaping of paths required.
+    func exec(_ arguments: [String], cd: String = "",
+              environment: [String: String] = [:]) -> Bool {
+        try? arguments.map { "'\($0.escaping("'", with: #"'\''"#))'" }
+            .joined(separator: " ").write(toFile: cmdfile,
+                                          atomically: false, encoding: .utf8)
+        debug(arguments)
+
+        let log = open(logfile, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0o644)
+        guard log >= 0 else {
+            _ = evalError("Could not open \(logfile): \(String(cString: strerror(errno)))")
+            return false
+        }
+        defer { close(log) }
+
+        var arguments = arguments
+        if !cd.isEmpty && spawnAddChdir == nil {
+            arguments = ["/bin/sh", "-c", #"cd "$0" && exec "$@""#, cd] + arguments
+        }
+
+        guard !isCancelled, let pid = Self.spawn(arguments, environment:
+            Self.toolEnvironment.merging(environment) { $1 }, actions: {
+            _ = posix_spawn_file_actions_addopen(&$0, STDIN_FILENO,
+                                                 "/dev/null", O_RDONLY, 0)
+            _ = posix_spawn_file_actions_adddup2(&$0, log, STDOUT_FILENO)
+            _ = posix_spawn_file_actions_adddup2(&$0, log, STDERR_FILENO)
+            if !cd.isEmpty, let addchdir = spawnAddChdir {
+                _ = addchdir(&$0, cd)
+            }
+        }) else {
+            if !isCancelled {
+                _ = evalError("posix_spawn() fails \(String(cString: strerror(errno)))")
+            }
+            return false
+        }
+        if !running(group: pid) {
+            kill(-pid, SIGTERM)
+        }
+        defer { _ = running(group: 0) }
+
+        var status: Int32 = 0
+        while waitpid(pid, &status, 0) == -1 && errno == EINTR {}
         return status == EXIT_SUCCESS
     }
 
-    #if !os(macOS)
-    lazy var runner = ScriptRunner()
+    /// Start a process with posix_spawn() rather than fork() as
+    /// nothing can safely run in the child of a multithreaded
+    /// process before it execs. Redirections are file actions.
+    /// Each process leads a new process group for cancel().
+    static func spawn(_ arguments: [String], environment: [String: String],
+                      actions: (inout SpawnFileActions) -> Void) -> pid_t? {
+        var argv = arguments.map { strdup($0) } + [nil]
+        var envp = environment.map { strdup("\($0.key)=\($0.value)") } + [nil]
+        defer { (argv + envp).forEach { free($0) } }
+
+        var fileActions: SpawnFileActions = nil
+        _ = posix_spawn_file_actions_init(&fileActions)
+        defer { _ = posix_spawn_file_actions_destroy(&fileActions) }
+        actions(&fileActions)
+        var attributes: SpawnAttributes = nil
+        _ = posix_spawnattr_init(&attributes)
+        defer { _ = posix_spawnattr_destroy(&attributes) }
+        _ = posix_spawnattr_setflags(&attributes, spawnSetProcessGroup)
+        _ = posix_spawnattr_setpgroup(&attributes, 0)
+
+        var pid: pid_t = 0
+        let path = argv[0]!
+        let error = posix_spawn(&pid, path, &fileActions, &attributes,
+                                &argv, &envp)
+        guard error == 0 else {
+            errno = error
+            return nil
+        }
+        return pid
+    }
+
+    /// Wall time taken by each step of the current rebuild.
+    var stepTimings = [(step: String, elapsed: TimeInterval)]()
+
+    func timed<T>(_ step: String, _ work: () throws -> T) rethrows -> T {
+        let started = Date.timeIntervalSinceReferenceDate
+        defer {
+            stepTimings.append((step,
+                Date.timeIntervalSinceReferenceDate - started))
+        }
+        return try work()
+    }
+
+    func reportTimings() {
+        if !stepTimings.isEmpty {
+            debug("Timings:", stepTimings.map { String(format: "%@ %.0fms",
+                $0.step, $0.elapsed * 1000.0) }.joined(separator: ", "))
+            stepTimings.removeAll()
+        }
+    }
 
+    var runner: ScriptRunner?
+
+    /// A long-lived bash that runs each script in a subshell of itself
+    /// so steps of a rebuild don't each pay for starting a new shell.
     class ScriptRunner {
         let commandsOut: UnsafeMutablePointer<FILE>
         let statusesIn: UnsafeMutablePointer<FILE>
+        let pid: pid_t
 
-        init() {
-            let ForReading = 0, ForWriting = 1
+        init?() {
+            let ForReading = 0, ForWriting = 1, statusFD: Int32 = 3
             var commandsPipe = [Int32](repeating: 0, count: 2)
             var statusesPipe = [Int32](repeating: 0, count: 2)
-            pipe(&commandsPipe)
-            pipe(&statusesPipe)
-
-            var envp = [UnsafeMutablePointer<CChar>?](repeating: nil, count: 2)
-            if let home = getenv("USER_HOME") {
-                envp[0] = strdup("HOME=\(home)")!
+            guard pipe(&commandsPipe) == 0 else { return nil }
+            guard pipe(&statusesPipe) == 0 else {
+                commandsPipe.forEach { close($0) }
+                return nil
             }
 
-            if fork() == 0 {
-                let commandsIn = fdopen(commandsPipe[ForReading], "r")
-                let statusesOut = fdopen(statusesPipe[ForWriting], "w")
-                var buffer = [Int8](repeating: 0, count: Int(MAXPATHLEN))
+            let spawned = SwiftEval.spawn(["/bin/bash", "-s"],
+                environment: SwiftEval.toolEnvironment, actions: {
+                _ = posix_spawn_file_actions_adddup2(&$0,
+                        commandsPipe[ForReading], STDIN_FILENO)
+                _ = posix_spawn_file_actions_adddup2(&$0,
+                        statusesPipe[ForWriting], statusFD)
+                for fd in commandsPipe + statusesPipe where fd != statusFD {
+                    _ = posix_spawn_file_actions_addclose(&$0, fd)
+                }
+            })
 
+            close(commandsPipe[ForReading])
+            close(statusesPipe[ForWriting])
+            guard let pid = spawned else {
                 close(commandsPipe[ForWriting])
                 close(statusesPipe[ForReading])
-                setbuf(statusesOut, nil)
-
-                while let script = fgets(&buffer, Int32(buffer.count), commandsIn) {
-                    script[strlen(script)-1] = 0
-
-                    let pid = fork()
-                    if pid == 0 {
-                        var argv = [UnsafeMutablePointer<Int8>?](repeating: nil, count: 3)
-                        argv[0] = strdup("/bin/bash")!
-                        argv[1] = strdup(script)!
-                        _ = execve(argv[0], &argv, &envp)
-                        fatalError("execve() fails \(String(cString: strerror(errno)))")
-                    }
-
-                    var status: Int32 = 0
-                    while waitpid(pid, &status, 0) == -1 {}
-                    fputs("\(status)\n", statusesOut)
-                }
-
-                exit(0)
+                return nil
             }
+            self.pid = pid
 
-            commandsOut = fdopen(commandsPipe[ForWriting], "w")
-            statusesIn = fdopen(statusesPipe[ForReading], "r")
-
-            close(commandsPipe[ForReading])
-            close(statusesPipe[ForWriting])
+            _ = fcntl(commandsPipe[ForWriting], F_SETNOSIGPIPE, 1)
+            _ = fcntl(commandsPipe[ForWriting], F_SETFD, FD_CLOEXEC)
+            _ = fcntl(statusesPipe[ForReading], F_SETFD, FD_CLOEXEC)
+            commandsOut = fdopen(commandsPipe[ForWriting], "w")!
+            statusesIn = fdopen(statusesPipe[ForReading], "r")!
             setbuf(commandsOut, nil)
         }
 
-        func run(script: String) -> Int32 {
-            fputs("\(script)\n", commandsOut)
+        /// Returns exit status of script or nil if the worker has gone away.
+        func run(script: String) -> Int32? {
+            let quoted = script.escaping("'", with: #"'\''"#)
+            // scripts mustn't inherit the worker's stdin of commands
+            guard fputs("(. '\(quoted)') </dev/null 3>&-; echo $? >&3\n",
+                        commandsOut) >= 0 else {
+                return nil
+            }
             var buffer = [Int8](repeating: 0, count: 20)
-            fgets(&buffer, Int32(buffer.count), statusesIn)
-            let status = atoi(buffer)
-            return status >> 8 | status & 0xff
+            guard fgets(&buffer, Int32(buffer.count), statusesIn) != nil else {
+                return nil
+            }
+            return atoi(buffer)
+        }
+
+        deinit {
+            fclose(commandsOut)
+            fclose(statusesIn)
+            var status: Int32 = 0
+            waitpid(pid, &status, 0)
         }
     }
-    #endif
 
     #if DEBUG
     deinit {
@@ -1312,11 +1665,53 @@ public class SwiftEval: NSObject {
     #endif
 }
 
-@_silgen_name("fork")
-func fork() -> Int32
-@_silgen_name("execve")
-func execve(_ __file: UnsafePointer<Int8>!,
-            _ __argv: UnsafePointer<UnsafeMutablePointer<Int8>?>!,
-            _ __envp: UnsafePointer<UnsafeMutablePointer<Int8>?>!) -> Int32
+// posix_spawn is not available to Swift in all the SDKs we build for
+typealias SpawnFileActions = UnsafeMutableRawPointer?
+typealias SpawnAttributes = UnsafeMutableRawPointer?
+let spawnSetProcessGroup: Int16 = 0x0002 // POSIX_SPAWN_SETPGROUP
+
+@_silgen_name("posix_spawn")
+func posix_spawn(_ pid: UnsafeMutablePointer<pid_t>,
+                 _ path: UnsafePointer<Int8>,
+                 _ fileActions: UnsafePointer<SpawnFileActions>,
+                 _ attributes: UnsafePointer<SpawnAttributes>?,
+                 _ argv: UnsafePointer<UnsafeMutablePointer<Int8>?>,
+                 _ envp: UnsafePointer<UnsafeMutablePointer<Int8>?>) -> Int32
+@_silgen_name("posix_spawn_file_actions_init")
+func posix_spawn_file_actions_init(
+    _ actions: UnsafeMutablePointer<SpawnFileActions>) -> Int32
+@_silgen_name("posix_spawn_file_actions_destroy")
+func posix_spawn_file_actions_destroy(
+    _ actions: UnsafeMutablePointer<SpawnFileActions>) -> Int32
+@_silgen_name("posix_spawn_file_actions_adddup2")
+func posix_spawn_file_actions_adddup2(
+    _ actions: UnsafeMutablePointer<SpawnFileActions>,
+    _ fd: Int32, _ newfd: Int32) -> Int32
+@_silgen_name("posix_spawn_file_actions_addclose")
+func posix_spawn_file_actions_addclose(
+    _ actions: UnsafeMutablePointer<SpawnFileActions>, _ fd: Int32) -> Int32
+@_silgen_name("posix_spawn_file_actions_addopen")
+func posix_spawn_file_actions_addopen(
+    _ actions: UnsafeMutablePointer<SpawnFileActions>, _ fd: Int32,
+    _ path: UnsafePointer<Int8>, _ oflag: Int32, _ mode: mode_t) -> Int32
+// Only available from macOS 10.15/iOS 13 so looked up at run time.
+let spawnAddChdir = dlsym(UnsafeMutableRawPointer(bitPattern: -2),
+    "posix_spawn_file_actions_addchdir_np").flatMap { unsafeBitCast($0, to:
+        (@convention(c) (UnsafeMutablePointer<SpawnFileActions>,
+                         UnsafePointer<Int8>) -> Int32)?.self) }
+@_silgen_name("posix_spawnattr_init")
+func posix_spawnattr_init(
+    _ attributes: UnsafeMutablePointer<SpawnAttributes>) -> Int32
+@_silgen_name("posix_spawnattr_destroy")
+func posix_spawnattr_destroy(
+    _ attributes: UnsafeMutablePointer<SpawnAttributes>) -> Int32
+@_silgen_name("posix_spawnattr_setflags")
+func posix_spawnattr_setflags(
+    _ attributes: UnsafeMutablePointer<SpawnAttributes>,
+    _ flags: Int16) -> Int32
+@_silgen_name("posix_spawnattr_setpgroup")
+func posix_spawnattr_setpgroup(
+    _ attributes: UnsafeMutablePointer<SpawnAttributes>,
+    _ group: pid_t) -> Int32
 #endif
 #endif
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 05/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftInjection.swift#223 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftInjection.swift#231 $
 //
 //  Cut-down version of code injection in Swift. Uses code
 //  from SwiftEval.swift to recompile and reload class.
@@ -168,8 +168,11 @@ public class SwiftInjection: NSObject {
 
     @objc
     open class func inject(tmpfile: String) throws {
-        try inject(tmpfile: tmpfile, newClasses:
-            SwiftEval.instance.loadAndInject(tmpfile: tmpfile))
+        let residentBefore = residentSize()
+        let newClasses = try SwiftEval.instance.loadAndInject(tmpfile: tmpfile)
+        try inject(tmpfile: tmpfile, newClasses: newClasses)
+        recordFootprint(newClasses: newClasses, residentBefore: residentBefore,
+                        tmpfile: tmpfile)
     }
 
     @objc
@@ -188,8 +191,8 @@ public class SwiftInjection: NSObject {
         }
 
         // Determine any generic classes being injected.
-        findSwiftSymbols(searchLastLoaded(), "CMa") {
-            accessor, symname, _, _ in
+        let index = SymbolIndex.of(tmpfile: tmpfile)
+        for (_, symname) in index.symbols(withSuffix: "CMa") {
             if let demangled = SwiftMeta.demangle(symbol: symname),
                let genericClassName = demangled[safe: (.last(of: " ")+1)...],
                !genericClassName.hasPrefix("__C.") {
@@ -389,7 +392,8 @@ public class SwiftInjection: NSObject {
 
         #if !targetEnvironment(simulator) && SWIFT_PACKAGE && canImport(InjectionScratch)
         if let pseudoImage = lastPseudoImage() {
-            onDeviceSpecificProcessing(for: pseudoImage, sweepClasses)
+            onDeviceSpecificProcessing(for: pseudoImage, sweepClasses,
+                                       tmpfile: tmpfile)
         }
         #endif
 
@@ -398,8 +402,7 @@ public class SwiftInjection: NSObject {
 
         // log any types being injected
         var ntypes = 0, npreviews = 0
-        findSwiftSymbols(searchLastLoaded(), "N") {
-            (typePtr, symbol, _, _) in
+        for (typePtr, symbol) in index.symbols(withSuffix: "N") {
             if let existing: Any.Type =
                 autoBitCast(dlsym(SwiftMeta.RTLD_DEFAULT, symbol)) {
                 let name = _typeName(existing)
@@ -407,7 +410,7 @@ public class SwiftInjection: NSObject {
                     npreviews += 1
                 }
                 if name.hasSuffix("PreviewRegistryfMu_") {
-                    return
+                    continue
                 }
                 ntypes += 1
                 log("Injected type #\(ntypes) '\(name)'")
@@ -505,35 +508,129 @@ public class SwiftInjection: NSObject {
     }
     #endif
 
+    /// Swift symbols, including local and hidden symbols, defined in the
+    /// dylib of an injection read in a single pass of its symbol table
+    /// indexed by the suffixes injection looks for so passes over the
+    /// dylib only visit the symbols they are interested in.
+    public class SymbolIndex {
+        public typealias Symbol = (address: UnsafeMutableRawPointer,
+                                   symname: SymbolName)
+        /// Suffixes looked for and whether only exported symbols were:
+        /// reducer initialisers, reverse interposing of witness tables
+        /// and statics, generic class accessors, type metadata, field
+        /// offsets on a device and type descriptors for statistics.
+        static let suffixes = [("_WZ", false), ("Wl", false), ("vau", false),
+            ("CMa", true), ("N", true), ("Wvd", false), ("Mn", true)]
+            .map { (suffix: $0.0, cString: $0.0.utf8CString, exported: $0.1) }
+        static var lastLoaded: SymbolIndex?
+
+        let tmpfile: String
+        var symbols = [Symbol]()
+        var bySuffix = [String: [Symbol]]()
+        /// Names are only made into Strings if a vtable is patched
+        lazy var byName: [String: UnsafeMutableRawPointer] = {
+            var byName = [String: UnsafeMutableRawPointer]()
+            byName.reserveCapacity(symbols.count)
+            for (address, symname) in symbols {
+                byName[String(cString: symname)] = address
+            }
+            return byName
+        }()
+
+        init(tmpfile: String) {
+            self.tmpfile = tmpfile
+            let lastLoaded = searchLastLoaded()
+            // pseudo images on a device can't be checked for exports
+            let image = dlopen(lastLoaded, RTLD_NOLOAD)
+            defer { _ = image.map { dlclose($0) } }
+            findHiddenSwiftSymbols(lastLoaded, "", .any) {
+                address, symname, _, _ in
+                self.symbols.append((address, symname))
+                let length = strlen(symname)
+                for entry in Self.suffixes where length >= entry.cString.count-1 &&
+                    entry.cString.withUnsafeBufferPointer({ strcmp(symname
+                        + length - ($0.count-1), $0.baseAddress!) == 0 }) {
+                    if entry.exported, let image = image,
+                       dlsym(image, symname) != address {
+                        continue
+                    }
+                    self.bySuffix[entry.suffix, default: []]
+                        .append((address, symname))
+                }
+            }
+        }
+
+        /// Index of the most recently loaded dylib built once per injection.
+        static func of(tmpfile: String) -> SymbolIndex {
+            if let index = lastLoaded, index.tmpfile == tmpfile {
+                return index
+            }
+            let index = SymbolIndex(tmpfile: tmpfile)
+            lastLoaded = index
+            return index
+        }
+
+        func symbols(withSuffix suffix: String) -> [Symbol] {
+            guard Self.suffixes.contains(where: { $0.suffix == suffix }) else {
+                var symbols = [Symbol]()
+                findHiddenSwiftSymbols(searchLastLoaded(), suffix, .any) {
+                    address, symname, _, _ in
+                    symbols.append((address, symname))
+                }
+                return symbols
+            }
+            return bySuffix[suffix] ?? []
+        }
+    }
+
     /// Newer way to patch vtable looking up existing entries individually in newly loaded dylib.
     open class func newPatchSwiftVtable(oldClass: AnyClass,// newClass: AnyClass?,
                                         tmpfile: String) -> Int {
-        var patched = 0
+        let symbols = SymbolIndex.of(tmpfile: tmpfile).byName
+        let interposed = NSObject.swiftTraceInterposed.bindMemory(to:
+            [UnsafeRawPointer : UnsafeRawPointer].self, capacity: 1)
+        var patched = 0, unchanged = 0, notInDylib = 0
 
         SwiftTrace.forEachVTableEntry(ofClass: oldClass) {
             (symname, slotIndex, vtableSlot, stop) in
             let existing: UnsafeMutableRawPointer = autoBitCast(vtableSlot.pointee)
-            guard let replacement = fast_dlsym(lastLoadedImage(), symname) ??
-                    (dlsym(SwiftMeta.RTLD_DEFAULT, symname) ??
-                     findSwiftSymbol(searchBundleImages(), symname, .any)).flatMap({
-                    autoBitCast(SwiftTrace.interposed(replacee: $0)) }) else {
-                log("⚠️ Class patching failed to lookup " +
-                    describeImageSymbol(symname))
+            let replacement: UnsafeMutableRawPointer
+            if let inDylib = symbols[String(cString: symname)] {
+                replacement = inDylib
+            } else if interposed.pointee[UnsafeRawPointer(existing)] != nil,
+                let current = SwiftTrace.interposed(replacee: existing) {
+                // Entries not in the dylib only need updating if
+                // their implementation was interposed since.
+                replacement = autoBitCast(current)
+            } else {
+                notInDylib += 1
+                // Inherited entries are never in the dylib so
+                // only look for missing symbols when detailing.
+                if injectionDetail &&
+                    dlsym(SwiftMeta.RTLD_DEFAULT, symname) == nil &&
+                    findSwiftSymbol(searchBundleImages(), symname, .any) == nil {
+                    log("⚠️ Class patching failed to lookup " +
+                        describeImageSymbol(symname))
+                }
                 return
             }
-            if replacement != existing {
-                traceAndReplace(existing, replacement: replacement, symname: symname) {
-                    (replacement: UnsafeMutableRawPointer) -> String? in
-                    vtableSlot.pointee = autoBitCast(replacement)
-                    if autoBitCast(vtableSlot.pointee) == replacement {
-                        patched += 1
-                        return "Patched"
-                    }
-                    return nil
+            guard replacement != existing else {
+                unchanged += 1
+                return
+            }
+            traceAndReplace(existing, replacement: replacement, symname: symname) {
+                (replacement: UnsafeMutableRawPointer) -> String? in
+                vtableSlot.pointee = autoBitCast(replacement)
+                if autoBitCast(vtableSlot.pointee) == replacement {
+                    patched += 1
+                    return "Patched"
                 }
+                return nil
             }
         }
 
+        detail("Vtable of \(_typeName(oldClass)) patched \(patched), " +
+               "unchanged \(unchanged), not in dylib \(notInDylib)")
         return patched
     }
 
@@ -615,9 +712,22 @@ public class SwiftInjection: NSObject {
 
     @objc(vaccine:)
     open class func performVaccineInjection(_ object: AnyObject) {
+        performVaccineInjection(object, targeting: nil)
+    }
+
+    /// Only reload views of the injected classes rather than whole hierarchies.
+    static let vaccineTargeted = getenv(INJECTION_VACCINE_TARGETED) != nil
+
+    open class func performVaccineInjection(_ object: AnyObject,
+                                            targeting injectedClasses: [AnyClass]?) {
         #if !os(watchOS)
-        let vaccine = Vaccine()
+        let started = Date.timeIntervalSinceReferenceDate
+        let vaccine = Vaccine(targeting: injectedClasses)
         vaccine.performInjection(on: object)
+        detail(String(format: "Vaccine %@ reload of %@ took %.1fms",
+                      injectedClasses != nil ? "targeted" : "full",
+                      "\(type(of: object))", (Date.timeIntervalSinceReferenceDate -
+                                                started) * 1000.0))
         #endif
     }
 
@@ -661,8 +771,8 @@ public class SwiftInjectionEval: UnhidingEval {
         #if false // Just too dubious
         // Determine any generic classes being injected.
         // (Done as part of sweep in the end.)
-        findSwiftSymbols(searchLastLoaded(), "CMa") {
-            accessor, _, _, _ in
+        for (accessor, _) in SymbolIndex.of(tmpfile: tmpfile)
+            .symbols(withSuffix: "CMa") {
             struct Something {}
             typealias AF = @convention(c) (UnsafeRawPointer, UnsafeRawPointer) -> UnsafeRawPointer
             let tmd: Any.Type = Void.self
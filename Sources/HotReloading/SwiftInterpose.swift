@@ -5,7 +5,7 @@
 //
 //  Interpose processing (-Xlinker -interposable).
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftInterpose.swift#11 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftInterpose.swift#12 $
 //
 
 #if DEBUG || !SWIFT_PACKAGE
@@ -155,9 +155,9 @@ extension SwiftInjection {
         if SwiftTrace.preserveStatics {
             symbolSuffixes.append("vau") // static variable "mutable addressors"
         }
+        let index = SymbolIndex.of(tmpfile: tmpfile)
         for suffix in symbolSuffixes {
-            findHiddenSwiftSymbols(searchLastLoaded(), suffix, .any) {
-                accessor, symname, _, _ in
+            for (accessor, symname) in index.symbols(withSuffix: suffix) {
                 var original = dlsym(SwiftMeta.RTLD_MAIN_ONLY, symname)
                 if original == nil {
                     original = findSwiftSymbol(searchBundleImages(), symname, .any)
@@ -167,7 +167,7 @@ extension SwiftInjection {
                     }
                 }
                 guard original != nil, already.insert(original!).inserted else {
-                    return
+                    continue
                 }
                 detail("Reverse interposing \(original!) <- \(accessor) " +
                        describeImagePointer(original!))
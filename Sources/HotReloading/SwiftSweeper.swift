@@ -7,7 +7,7 @@
 //  instance of classes that have been injected in order
 //  to be able to send them the @objc injected message.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftSweeper.swift#23 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/SwiftSweeper.swift#24 $
 //
 
 #if DEBUG || !SWIFT_PACKAGE
@@ -87,7 +87,8 @@ extension SwiftInjection {
                         injectedGenerics: injectedGenerics, patched: &patched) {
                     let proto = unsafeBitCast(instance, to: SwiftInjected.self)
                     if SwiftEval.sharedInstance().vaccineEnabled {
-                        performVaccineInjection(instance)
+                        performVaccineInjection(instance, targeting:
+                            vaccineTargeted ? injectedClasses : nil)
                         proto.injected?()
                         return
                     }
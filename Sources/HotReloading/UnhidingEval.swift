@@ -3,7 +3,7 @@
 //
 //  Created by John Holdsworth on 13/04/2021.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloading/UnhidingEval.swift#27 $
+//  $Id: //depot/HotReloading/Sources/HotReloading/UnhidingEval.swift#31 $
 //
 //  Retro-fit Unhide into InjectionIII
 //
@@ -245,12 +245,11 @@ public class UnhidingEval: SwiftEval {
     // Assorted bazel code moved out of SwiftEval.swift
     override func bazelLink(in projectRoot: String, since sourceFile: String,
                    compileCommand: String) throws -> String {
-        guard var objects = bazelFiles(under: projectRoot, where: """
-            -newer "\(sourceFile)" -a -name '*.o' | \
-            egrep '(_swift_incremental|_objs)/' | grep -v /external/
-            """) else {
+        let index = bazelIndex(for: projectRoot)
+        guard timed("bazel index", { index.refresh() }) else {
             throw evalError("Finding Objects failed. Did you actually make a change to \(sourceFile) and does it compile? InjectionIII does not support whole module optimization. (check logfile: \(logfile))")
         }
+        var objects = index.objects(newerThan: sourceFile)
 
         debug(bazelLight, projectRoot, objects)
         // precendence to incrementally compiled
@@ -268,33 +267,12 @@ public class UnhidingEval: SwiftEval {
         // for the module name to include its library.
         if objects.count > 1 {
             let objectSet = Set(objects)
-            if let maps  = bazelFiles(under: projectRoot,
-                                      where: "-name '*output_file_map*.json'") {
-                let relativePath = sourceFile .replacingOccurrences(
-                    of: projectRoot+"/", with: "")
-                for map in maps {
-                    if let data = try? Data(contentsOf: URL(
-                        fileURLWithPath: projectRoot)
-                        .appendingPathComponent(map)),
-                       let json = try? JSONSerialization.jsonObject(
-                        with: data, options: []) as? [String: Any],
-                       let info = json[relativePath] as? [String: String] {
-                        if let object = info["object"],
-                           objectSet.contains(object) {
-                            objects = [object]
-                            if let module: String =
-                                map[#"(\w+)\.output_file_map"#] {
-                                for lib in bazelFiles(under: projectRoot,
-                                    where: "-name 'lib\(module).a'") ?? [] {
-                                    moduleLibraries.insert(lib)
-                                }
-                            }
-                            break
-                        }
-                    }
-                }
-            } else {
-                _ = evalError("Error reading maps")
+            let relativePath = sourceFile .replacingOccurrences(
+                of: projectRoot+"/", with: "")
+            if let output = index.outputs(of: relativePath)
+                .first(where: { objectSet.contains($0.object) }) {
+                objects = [output.object]
+                moduleLibraries.formUnion(index.libraries(of: output.module))
             }
         }
         #endif
@@ -303,22 +281,17 @@ public class UnhidingEval: SwiftEval {
         debug(objects)
 
         try link(dylib: "\(tmpfile).dylib", compileCommand: compileCommand,
-                 contents: objects.map({ "\"\($0)\""}).joined(separator: " "),
-                 cd: projectRoot)
+                 objects: objects, cd: projectRoot)
         return tmpfile
     }
 
-    func bazelFiles(under projectRoot: String, where clause:  String,
-                    ext: String = "files") -> [String]? {
-        let list = "\(tmpfile).\(ext)"
-        if shell(command: """
-            cd "\(projectRoot)" && \
-            find bazel-out/* \(clause) >"\(list)" 2>>\"\(logfile)\"
-            """), let files = (try? String(contentsOfFile: list))?
-            .components(separatedBy: "\n").dropLast() {
-            return Array(files)
-        }
-        return nil
+    var bazelOut: BazelIndex?
+
+    func bazelIndex(for projectRoot: String) -> BazelIndex {
+        if bazelOut?.projectRoot != projectRoot {
+            bazelOut = BazelIndex(projectRoot: projectRoot)
+        }
+        return bazelOut!
     }
 
     override func bazelLight(projectRoot: String, recompile sourceFile: String) throws -> String? {
@@ -453,13 +426,22 @@ public class UnhidingEval: SwiftEval {
         let params = returned[0]
         _ = evalError("Compiling using parameters from \(params)")
 
+        // objects of the module being recompiled need to be writable
+        let index = bazelIndex(for: projectRoot)
+        _ = timed("bazel index", { index.refresh() })
+        let recompiled = returned.dropFirst().first
+        let module = index.outputs(of: relativePath)
+            .first(where: { $0.object == recompiled })
+        for object in module.map({ index.objects(of: $0.map) }) ??
+            Array(index.objects.keys) {
+            index.makeWritable(object)
+        }
+
         guard shell(command: """
                 cd "\(projectRoot)" && \
-                chmod +w `find bazel-out/* -name '*.o'`; \
                 xcrun swiftc @\(params) >\"\(logfile)\" 2>&1
                 """) || shell(command: """
                 cd `readlink "\(projectRoot)/bazel-out"`/.. && \
-                chmod +w `find bazel-out/* -name '*.o'`; \
                 xcrun swiftc @\(params) >>\"\(logfile)\" 2>&1
                 """),
               let compileCommand = try? String(contentsOfFile: params) else {
@@ -471,4 +453,347 @@ public class UnhidingEval: SwiftEval {
     }
 
 }
+
+/// In-memory index of the objects, output file maps and static
+/// libraries in a project's bazel-out so an injection doesn't
+/// need to walk the whole tree with find(1). After the initial
+/// walk an FSEvents stream records the paths that change and
+/// only those are re-examined. Where events are not available
+/// directories are re-read when their modification time changes.
+class BazelIndex {
+
+    struct Directory {
+        var mtime: TimeInterval
+        var subdirs = Set<String>()
+        var files = Set<String>()
+    }
+
+    typealias Output = (object: String, module: String, map: String)
+
+    let projectRoot: String
+    /// Directories by path relative to project root
+    var directories = [String: Directory]()
+    /// Object files by last known modification time
+    var objects = [String: TimeInterval]()
+    /// The same objects in order of modification time
+    var objectsByTime = [(mtime: TimeInterval, path: String)]()
+    /// Output file maps by modification time when parsed
+    var outputFileMaps = [String: TimeInterval]()
+    /// Object and module of source files from output file maps
+    var sourceOutputs = [String: [Output]]()
+    var mapSources = [String: [String]]()
+    /// Static libraries by file name
+    var libraries = [String: Set<String>]()
+
+    #if targetEnvironment(simulator) && !APP_SANDBOXED || os(macOS)
+    var watcher: FileWatcher?
+    #endif
+    /// bazel-out with symlinks resolved, as reported by FSEvents
+    var realOut = ""
+    /// Paths changed since last refresh, nil when a walk is required
+    var changed: Set<String>?
+    let changedLock = NSLock()
+    static var maxChanges = 10_000
+    static let watcherQueue = DispatchQueue(label: "BazelIndexWatcher")
+
+    init(projectRoot: String) {
+        self.projectRoot = projectRoot
+    }
+
+    func mtime(of info: stat) -> TimeInterval {
+        return TimeInterval(info.st_mtimespec.tv_sec) +
+            TimeInterval(info.st_mtimespec.tv_nsec) / 1_000_000_000
+    }
+
+    func mtime(of path: String, follow: Bool = true) -> TimeInterval? {
+        var info = stat()
+        let path = path.hasPrefix("/") ? path : projectRoot+"/"+path
+        guard (follow ? stat(path, &info) : lstat(path, &info)) == 0 else {
+            return nil
+        }
+        return mtime(of: info)
+    }
+
+    /// Bring the index up to date.
+    /// - Returns: false if bazel-out could not be read
+    func refresh() -> Bool {
+        #if targetEnvironment(simulator) && !APP_SANDBOXED || os(macOS)
+        watcher?.flush()
+        #endif
+        changedLock.lock()
+        let changes = changed
+        changed = watching ? [] : nil
+        changedLock.unlock()
+
+        if let changes = changes {
+            for path in changes where path.hasPrefix(realOut) {
+                apply(change: "bazel-out"+path.dropFirst(realOut.count))
+            }
+            return true
+        }
+
+        startWatching()
+        guard update(directory: "bazel-out") else {
+            return false
+        }
+        // Directory mtimes miss objects and maps rewritten in place.
+        // Re-stat them on every walk, including after FSEvents overflowed.
+        for object in Array(objects.keys) {
+            setObject(object, modified: mtime(of: object, follow: false))
+        }
+        for (map, parsed) in outputFileMaps {
+            if let modified = mtime(of: map), modified != parsed {
+                parse(map: map, modified: modified)
+            }
+        }
+        return true
+    }
+
+    var watching: Bool {
+        #if targetEnvironment(simulator) && !APP_SANDBOXED || os(macOS)
+        return watcher != nil
+        #else
+        return false
+        #endif
+    }
+
+    func startWatching() {
+        #if targetEnvironment(simulator) && !APP_SANDBOXED || os(macOS)
+        guard watcher == nil,
+              let real = realpath(projectRoot+"/bazel-out", nil) else {
+            return
+        }
+        realOut = String(cString: real)
+        free(real)
+        changedLock.lock()
+        changed = []
+        changedLock.unlock()
+        watcher = FileWatcher(roots: [realOut], callback: {
+            [weak self] changes, _ in
+            guard let self = self else { return }
+            self.changedLock.lock()
+            defer { self.changedLock.unlock() }
+            self.changed?.formUnion(changes.compactMap { $0 as? String })
+            if let count = self.changed?.count, count > BazelIndex.maxChanges {
+                self.changed = nil // too many, walk the tree instead
+            }
+        }, allFiles: true, queue: Self.watcherQueue)
+        #endif
+    }
+
+    /// Re-examine a path reported as changed by FSEvents.
+    func apply(change path: String) {
+        var info = stat()
+        if lstat(projectRoot+"/"+path, &info) == 0 &&
+            info.st_mode & S_IFMT == S_IFDIR {
+            _ = update(directory: path, recursive: false)
+            return
+        }
+        let dirname = (path as NSString).deletingLastPathComponent
+        let name = (path as NSString).lastPathComponent
+        guard var parent = directories[dirname] else {
+            return // indexed when its directory is
+        }
+        if refresh(file: path) {
+            parent.files.insert(name)
+        } else {
+            parent.files.remove(name)
+            if parent.subdirs.remove(name) != nil {
+                forget(directory: path)
+            }
+        }
+        directories[dirname] = parent
+    }
+
+    /// Re-read a directory if its modification time has changed,
+    /// keeping the entries of files that have not been modified.
+    /// Known subdirectories are only revisited when recursive.
+    func update(directory: String, recursive: Bool = true) -> Bool {
+        guard let modified = mtime(of: directory) else {
+            forget(directory: directory)
+            return false
+        }
+        var entry = directories[directory] ?? Directory(mtime: -1)
+        if entry.mtime != modified {
+            guard let dir = opendir(projectRoot+"/"+directory) else {
+                return false
+            }
+            defer { closedir(dir) }
+
+            var listed = Directory(mtime: modified)
+            while let ent = readdir(dir) {
+                let name = withUnsafePointer(to: &ent.pointee.d_name) {
+                    String(cString: UnsafeRawPointer($0)
+                        .assumingMemoryBound(to: CChar.self))
+                }
+                switch Int32(ent.pointee.d_type) {
+                case DT_DIR where name != "." && name != "..":
+                    listed.subdirs.insert(name)
+                case DT_REG where refresh(file: directory+"/"+name):
+                    listed.files.insert(name)
+                default:
+                    break // symbolic links are not followed, as with find
+                }
+            }
+            for removed in entry.files.subtracting(listed.files) {
+                remove(file: directory+"/"+removed)
+            }
+            for removed in entry.subdirs.subtracting(listed.subdirs) {
+                forget(directory: directory+"/"+removed)
+            }
+            entry = listed
+            directories[directory] = entry
+        }
+        for subdir in entry.subdirs where recursive ||
+            directories[directory+"/"+subdir] == nil {
+            _ = update(directory: directory+"/"+subdir)
+        }
+        return true
+    }
+
+    func forget(directory: String) {
+        guard let entry = directories.removeValue(forKey: directory) else {
+            return
+        }
+        entry.files.forEach { remove(file: directory+"/"+$0) }
+        entry.subdirs.forEach { forget(directory: directory+"/"+$0) }
+    }
+
+    /// Add or update the entry for a file, re-parsing an
+    /// output file map only if it has been modified.
+    /// - Returns: true if the file exists and is indexed
+    func refresh(file path: String) -> Bool {
+        var info = stat()
+        guard lstat(projectRoot+"/"+path, &info) == 0,
+              info.st_mode & S_IFMT == S_IFREG else {
+            remove(file: path)
+            return false
+        }
+        let modified = mtime(of: info)
+        let file = (path as NSString).lastPathComponent
+        if file.hasSuffix(".o") {
+            setObject(path, modified: modified)
+        } else if file.hasSuffix(".json") && file.contains("output_file_map") {
+            if outputFileMaps[path] != modified {
+                parse(map: path, modified: modified)
+            }
+        } else if file.hasPrefix("lib") && file.hasSuffix(".a") {
+            libraries[file, default: []].insert(path)
+        } else {
+            return false
+        }
+        return true
+    }
+
+    func remove(file path: String) {
+        let file = (path as NSString).lastPathComponent
+        setObject(path, modified: nil)
+        libraries[file]?.remove(path)
+        unparse(map: path)
+    }
+
+    /// Position of the first object modified after a time.
+    func firstObject(after time: TimeInterval) -> Int {
+        var low = 0, high = objectsByTime.count
+        while low < high {
+            let mid = (low + high) / 2
+            if objectsByTime[mid].mtime <= time {
+                low = mid + 1
+            } else {
+                high = mid
+            }
+        }
+        return low
+    }
+
+    func setObject(_ path: String, modified: TimeInterval?) {
+        let previous = objects[path]
+        guard modified != previous else {
+            return
+        }
+        if let previous = previous {
+            var position = firstObject(after: previous) - 1
+            while objectsByTime[position].path != path {
+                position -= 1
+            }
+            objectsByTime.remove(at: position)
+        }
+        objects[path] = modified
+        if let modified = modified {
+            objectsByTime.insert((modified, path),
+                                 at: firstObject(after: modified))
+        }
+    }
+
+    func parse(map: String, modified: TimeInterval) {
+        unparse(map: map)
+        outputFileMaps[map] = modified
+        guard let data = try? Data(contentsOf: URL(
+                fileURLWithPath: projectRoot).appendingPathComponent(map)),
+              let json = try? JSONSerialization.jsonObject(
+                with: data, options: []) as? [String: Any] else {
+            return
+        }
+        let module: String? = map[#"(\w+)\.output_file_map"#]
+        var sources = [String]()
+        for (source, info) in json {
+            if let object = (info as? [String: String])?["object"] {
+                sourceOutputs[source, default: []]
+                    .append((object, module ?? "", map))
+                sources.append(source)
+            }
+        }
+        mapSources[map] = sources
+    }
+
+    func unparse(map: String) {
+        guard outputFileMaps.removeValue(forKey: map) != nil else {
+            return
+        }
+        for source in mapSources.removeValue(forKey: map) ?? [] {
+            sourceOutputs[source]?.removeAll(where: { $0.map == map })
+        }
+    }
+
+    /// Equivalent of find -newer source -name '*.o' for the
+    /// objects of Swift modules, excluding external modules.
+    /// Only objects modified after the source are visited.
+    func objects(newerThan sourceFile: String) -> [String] {
+        guard let since = mtime(of: sourceFile) else {
+            return []
+        }
+        // the source's own objects may have been written
+        // too recently for their events to have arrived.
+        let relativePath = sourceFile.replacingOccurrences(
+            of: projectRoot+"/", with: "")
+        for output in outputs(of: relativePath) {
+            _ = refresh(file: output.object)
+        }
+        return objectsByTime[firstObject(after: since)...]
+            .map { $0.path }.filter { !$0.contains("/external/") &&
+                ($0.contains("_swift_incremental/") || $0.contains("_objs/")) }
+    }
+
+    func outputs(of relativePath: String) -> [Output] {
+        return sourceOutputs[relativePath] ?? []
+    }
+
+    func objects(of map: String) -> [String] {
+        return (mapSources[map] ?? []).flatMap {
+            outputs(of: $0).filter { $0.map == map }.map { $0.object }
+        }
+    }
+
+    func libraries(of module: String) -> Set<String> {
+        return libraries["lib\(module).a"] ?? []
+    }
+
+    func makeWritable(_ object: String) {
+        var info = stat()
+        let path = projectRoot+"/"+object
+        if stat(path, &info) == 0 && info.st_mode & S_IWUSR == 0 {
+            _ = chmod(path, info.st_mode | S_IWUSR)
+        }
+    }
+}
 #endif
@@ -23,6 +23,20 @@ extension View {
 }
 
 class Vaccine {
+    /// Injected classes (including KVO subclasses) if reloading is to be
+    /// limited to views of those classes and the views that contain them.
+    let targets: [AnyClass]?
+
+    init(targeting injectedClasses: [AnyClass]? = nil) {
+        targets = injectedClasses
+    }
+
+    func isTarget(_ object: AnyObject) -> Bool {
+        guard let targets = targets else { return true }
+        let cls: AnyClass? = object_getClass(object)
+        return targets.contains { $0 == cls }
+    }
+
     func performInjection(on object: AnyObject) {
         switch object {
         case let viewController as ViewController:
@@ -37,12 +51,18 @@ class Vaccine {
             let oldScrollViews = indexScrollViews(on: viewController)
 
             #if os(macOS)
-            reload(viewController.parent ?? viewController)
+            if let parentViewController = viewController.parent,
+               targets == nil || isTarget(parentViewController) {
+                reload(parentViewController)
+            } else {
+                reload(viewController)
+            }
             #else
             // Opt-out from performing Vaccine reloads on parent
             // if the parent is either a navigation controller or
             // a tab bar controller.
-            if let parentViewController = viewController.parent {
+            if let parentViewController = viewController.parent,
+               targets == nil || isTarget(parentViewController) {
               if parentViewController is UINavigationController {
                 reload(viewController)
               } else if parentViewController is UITabBarController {
@@ -59,6 +79,13 @@ class Vaccine {
             cleanSnapshotViewIfNeeded(snapshotView, viewController: viewController)
         case let view as View:
             reload(view)
+            if targets != nil {
+                #if os(macOS)
+                view.superview?.needsLayout = true
+                #else
+                view.superview?.setNeedsLayout()
+                #endif
+            }
         default:
             break
         }
@@ -148,8 +175,10 @@ class Vaccine {
     }
 
     private func refreshSubviews(on view: View) {
+        let subviews = targets != nil ?
+            affectedSubviews(of: view) : view.subviewsRecursive()
         #if os(macOS)
-        view.subviewsRecursive().forEach { view in
+        subviews.forEach { view in
             (view as? NSTableView)?.reloadData()
             (view as? NSCollectionView)?.reloadData()
             view.needsLayout = true
@@ -158,7 +187,7 @@ class Vaccine {
             view.display()
         }
         #else
-        view.subviewsRecursive().forEach { view in
+        subviews.forEach { view in
             (view as? UITableView)?.reloadData()
             (view as? UICollectionView)?.reloadData()
             view.setNeedsLayout()
@@ -168,6 +197,26 @@ class Vaccine {
         #endif
     }
 
+    /// Direct subviews, then any deeper views of injected
+    /// classes along with the superviews that lay them out.
+    private func affectedSubviews(of view: View) -> [View] {
+        var affected = view.subviews
+        var seen = Set(affected.map { ObjectIdentifier($0) })
+        func visit(_ view: View) {
+            for subview in view.subviews {
+                if isTarget(subview) {
+                    for dependent in [view, subview] where
+                        seen.insert(ObjectIdentifier(dependent)).inserted {
+                        affected.append(dependent)
+                    }
+                }
+                visit(subview)
+            }
+        }
+        view.subviews.forEach(visit)
+        return affected
+    }
+
     private func indexScrollViews(on viewController: ViewController) -> [ScrollView] {
         var scrollViews = [ScrollView]()
 
@@ -175,7 +224,9 @@ class Vaccine {
             scrollViews.append(scrollView)
         }
 
-        if let parentViewController = viewController.parent {
+        // the parent is only reloaded when targeting its class
+        if let parentViewController = viewController.parent,
+           targets == nil || isTarget(parentViewController) {
             for case let scrollView as ScrollView in parentViewController.view.subviews {
                 scrollViews.append(scrollView)
             }
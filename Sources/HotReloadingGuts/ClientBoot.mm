@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 02/24/2021.
 //  Copyright © 2021 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/ClientBoot.mm#131 $
+//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/ClientBoot.mm#135 $
 //
 //  Initiate connection to server side of InjectionIII/HotReloading.
 //
@@ -16,29 +16,98 @@
 #import <objc/runtime.h>
 #import "SimpleSocket.h"
 #import <dlfcn.h>
+#import <mach-o/loader.h>
 
 #ifndef INJECTION_III_APP
 NSString *INJECTION_KEY = @__FILE__;
 #endif
 
+/// LC_UUID of the main executable which changes with each build.
+NSString *executable_uuid() {
+    const struct mach_header_64 *header =
+        (const struct mach_header_64 *)_dyld_get_image_header(0);
+    if (!header)
+        return nil;
+    const struct load_command *cmd = (const struct load_command *)(header + 1);
+    for (uint32_t i = 0; i < header->ncmds; i++) {
+        if (cmd->cmd == LC_UUID)
+            return [[NSUUID alloc] initWithUUIDBytes:
+                    ((const struct uuid_command *)cmd)->uuid].UUIDString;
+        cmd = (const struct load_command *)((const char *)cmd + cmd->cmdsize);
+    }
+    return nil;
+}
+
 #if defined(DEBUG) || defined(INJECTION_III_APP)
 static SimpleSocket *injectionClient;
 NSString *injectionHost = @"127.0.0.1";
 static dispatch_once_t onlyOneClient;
+static dispatch_semaphore_t clientConnected;
+static NSTimeInterval connectStarted;
+
+// Upper bounds on how long locating the server can take.
+static const NSTimeInterval CONNECT_TIMEOUT = 1.0, DISCOVERY_TIMEOUT = 3.0;
+// Last server address that connected for this build of the app, kept in
+// a defaults domain of our own so as not to pollute the app's defaults.
+static NSString *const lastHostDomain = @"com.johnholdsworth.HotReloading";
+static NSString *const lastHostKey = @"LastHost", *const lastBuildKey = @"Build";
+
+static NSUserDefaults *lastHostDefaults() {
+    static NSUserDefaults *defaults;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        defaults = [[NSUserDefaults alloc] initWithSuiteName:lastHostDomain];
+    });
+    return defaults;
+}
 
 @implementation SimpleSocket(Connect)
 
-+ (void)backgroundConnect:(const char *)host {
++ (void)connected:(SimpleSocket *)client host:(NSString *)host {
+    dispatch_once(&onlyOneClient, ^{
+        if (host) {
+            injectionHost = host;
+            if (NSString *build = executable_uuid())
+                [lastHostDefaults() setObject:@{lastBuildKey: build,
+                    lastHostKey: host} forKey:lastHostKey];
+        }
+        if (getenv(INJECTION_DEBUG))
+            printf(APP_PREFIX"Connected to %s in %.0fms\n", injectionHost.UTF8String,
+                   ([NSDate timeIntervalSinceReferenceDate]-connectStarted)*1000.);
+        [injectionClient = client run];
+        if (clientConnected)
+            dispatch_semaphore_signal(clientConnected);
+    });
+}
+
++ (void)backgroundConnect:(NSString *)host {
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
-        if (SimpleSocket *client = [[self class] connectTo:[NSString
-                stringWithFormat:@"%s%@", host, @INJECTION_ADDRESS]])
-            dispatch_once(&onlyOneClient, ^{
-                injectionHost = [NSString stringWithUTF8String:host];
-                [injectionClient = client run];
-            });
+        if (SimpleSocket *client = [self connectTo:[host
+                stringByAppendingString:@INJECTION_ADDRESS] timeout:CONNECT_TIMEOUT])
+            [self connected:client host:host];
     });
 }
 
+/// Race connections to candidate hosts in the background. Numeric
+/// addresses are connected to in parallel while host names are each
+/// resolved separately so a slow lookup can not hold up the others.
++ (void)backgroundConnectToFirstOf:(NSOrderedSet<NSString *> *)hosts {
+    NSMutableArray<NSString *> *addresses = [NSMutableArray new];
+    for (NSString *host in hosts)
+        if (isdigit(host.UTF8String[0]))
+            [addresses addObject:[host stringByAppendingString:@INJECTION_ADDRESS]];
+        else
+            [self backgroundConnect:host];
+    if (addresses.count)
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSString *winner;
+            if (SimpleSocket *client = [self connectToFirstOf:addresses
+                                           timeout:CONNECT_TIMEOUT winner:&winner])
+                [self connected:client host:[winner
+                    componentsSeparatedByString:@":"].firstObject];
+        });
+}
+
 @end
 
 @interface BundleInjection: NSObject
@@ -97,6 +166,8 @@ extern "C" {
         "https://github.com/johnno1962/InjectionIII/releases\n"
     APP_PREFIX"And have typed: defaults write com.johnholdsworth.InjectionIII deviceUnlock any\n";
     BOOL isVapor = dlsym(RTLD_DEFAULT, VAPOR_SYMBOL) != nullptr;
+    NSString *connectHost = nil;
+    connectStarted = [NSDate timeIntervalSinceReferenceDate];
 #if TARGET_IPHONE_SIMULATOR || TARGET_OS_OSX
 #if 0 && !defined(INJECTION_III_APP)
     BOOL isiOSAppOnMac = false;
@@ -110,32 +181,61 @@ extern "C" {
         }
 #endif
 #elif TARGET_OS_IPHONE
+    // Candidate servers: last to connect, environment and configured.
+    NSMutableOrderedSet<NSString *> *candidates = [NSMutableOrderedSet new];
+    NSDictionary *lastHost = [lastHostDefaults() dictionaryForKey:lastHostKey];
+    if ([lastHost[lastBuildKey] isEqual:executable_uuid()] &&
+        [lastHost[lastHostKey] isKindOfClass:[NSString class]])
+        [candidates addObject:lastHost[lastHostKey]];
     const char *envHost = getenv(INJECTION_HOST);
     if (envHost)
-        [clientClass backgroundConnect:envHost];
+        [candidates addObject:[NSString stringWithUTF8String:envHost]];
     #ifdef DEVELOPER_HOST
-    [clientClass backgroundConnect:DEVELOPER_HOST];
+    [candidates addObject:@DEVELOPER_HOST];
     if (!isdigit(DEVELOPER_HOST[0]) && !envHost)
         printf(APP_PREFIX"Sending broadcast packet to connect to your development host %s.\n"
                APP_PREFIX"If this fails, hardcode your Mac's IP address in HotReloading/Package.swift\n"
                "   or add an environment variable " INJECTION_HOST
                " with this value.\n%s", DEVELOPER_HOST, buildPhase);
     #endif
-    if (!(@available(iOS 14.0, *) && [NSProcessInfo processInfo].isiOSAppOnMac))
-        injectionHost = [clientClass
+    clientConnected = dispatch_semaphore_create(0);
+    [clientClass backgroundConnectToFirstOf:candidates];
+    // Give the candidates a chance before resorting to discovery.
+    if (dispatch_semaphore_wait(clientConnected, dispatch_time(DISPATCH_TIME_NOW,
+                                (int64_t)(CONNECT_TIMEOUT * NSEC_PER_SEC))) == 0)
+        return;
+    if (!(@available(iOS 14.0, *) && [NSProcessInfo processInfo].isiOSAppOnMac)) {
+        connectHost = [clientClass
         getMulticastService:HOTRELOADING_MULTICAST port:HOTRELOADING_PORT
-                    message:APP_PREFIX"Connecting to %s (%s)...\n"];
-    socketAddr = [injectionHost stringByAppendingString:@HOTRELOADING_PORT];
+                    message:APP_PREFIX"Connecting to %s (%s)...\n"
+                    timeout:DISCOVERY_TIMEOUT];
+        if (!connectHost && !injectionClient) {
+            printf(APP_PREFIX"⚠️ Could not locate a development host to connect to "
+                   "within %.0fs. Is InjectionIII.app running?\n",
+                   CONNECT_TIMEOUT + DISCOVERY_TIMEOUT);
+            return;
+        }
+    }
     if (injectionClient)
         return;
+    socketAddr = [connectHost ?: injectionHost
+                  stringByAppendingString:@HOTRELOADING_PORT];
+#endif
+#if TARGET_IPHONE_SIMULATOR || TARGET_OS_OSX
+    // Prefer the server's Unix domain socket, falling back to TCP.
+    if (!getenv(INJECTION_NOUNIX))
+        if (SimpleSocket *client = [clientClass connectTo:@INJECTION_SOCKET
+                                                  timeout:CONNECT_TIMEOUT]) {
+            [clientClass connected:client host:connectHost];
+            return;
+        }
 #endif
     for (int retry=0, retrys=1; retry<retrys; retry++) {
         if (retry)
-            [NSThread sleepForTimeInterval:1.0];
-        if (SimpleSocket *client = [clientClass connectTo:socketAddr]) {
-            dispatch_once(&onlyOneClient, ^{
-                [injectionClient = client run];
-            });
+            [NSThread sleepForTimeInterval:.1];
+        if (SimpleSocket *client = [clientClass connectTo:socketAddr
+                                                  timeout:CONNECT_TIMEOUT]) {
+            [clientClass connected:client host:connectHost];
             return;
         }
     }
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 06/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/SimpleSocket.mm#63 $
+//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/SimpleSocket.mm#68 $
 //
 //  Server and client primitives for networking through sockets
 //  more esailly written in Objective-C than Swift. Subclass to
@@ -17,10 +17,13 @@
 #import "SimpleSocket.h"
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <poll.h>
+#include <vector>
 
 #if 0
 #define SLog NSLog
@@ -37,6 +40,7 @@ typedef union {
     };
     struct sockaddr_storage any;
     struct sockaddr_in ip4;
+    struct sockaddr_un local;
     struct sockaddr addr;
 } sockaddr_union;
 
@@ -67,12 +71,30 @@ typedef union {
 
 + (void)runServer:(NSString *)address {
     sockaddr_union serverAddr;
-    [self parseV4Address:address into:&serverAddr.any];
+    if (![self parseAddress:address into:&serverAddr.any])
+        return;
 
     int serverSocket = [self newSocket:serverAddr.sa_family];
     if (serverSocket < 0)
         return;
 
+    // remove any socket file left behind by a previous
+    // server unless there is a server still listening on it
+    if (serverAddr.sa_family == AF_UNIX) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        BOOL live = probe >= 0 &&
+            connect(probe, &serverAddr.addr, serverAddr.sa_len) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live) {
+            NSLog(@"%@: %s is in use by another server", self,
+                  serverAddr.local.sun_path);
+            close(serverSocket);
+            return;
+        }
+        unlink(serverAddr.local.sun_path);
+    }
+
     if (bind(serverSocket, &serverAddr.addr, serverAddr.sa_len) < 0)
         [self error:@"Could not bind service socket: %s"];
     else if (listen(serverSocket, 5) < 0)
@@ -88,16 +110,22 @@ typedef union {
                 if (setsockopt(clientSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof yes) < 0)
                     [self error:@"Could not set SO_NOSIGPIPE: %s"];
                 @autoreleasepool {
-                    struct sockaddr_in *v4Addr = &clientAddr.ip4;
-                    NSLog(@"Connection from %s:%d\n",
-                          inet_ntoa(v4Addr->sin_addr), ntohs(v4Addr->sin_port));
                     SimpleSocket *client = [[self alloc] initSocket:clientSocket];
-                    client.isLocalClient =
-                        v4Addr->sin_addr.s_addr == htonl(INADDR_LOOPBACK);
-                    [self forEachInterface:^(ifaddrs *ifa, in_addr_t addr, in_addr_t mask) {
-                        if (v4Addr->sin_addr.s_addr == addr)
-                            client.isLocalClient = TRUE;
-                    }];
+                    if (serverAddr.sa_family == AF_UNIX) {
+                        NSLog(@"Connection on %s\n", serverAddr.local.sun_path);
+                        client.isLocalClient = TRUE;
+                    }
+                    else {
+                        struct sockaddr_in *v4Addr = &clientAddr.ip4;
+                        NSLog(@"Connection from %s:%d\n",
+                              inet_ntoa(v4Addr->sin_addr), ntohs(v4Addr->sin_port));
+                        client.isLocalClient =
+                            v4Addr->sin_addr.s_addr == htonl(INADDR_LOOPBACK);
+                        [self forEachInterface:^(ifaddrs *ifa, in_addr_t addr, in_addr_t mask) {
+                            if (v4Addr->sin_addr.s_addr == addr)
+                                client.isLocalClient = TRUE;
+                        }];
+                    }
                     [client run];
                 }
             }
@@ -108,7 +136,8 @@ typedef union {
 
 + (instancetype)connectTo:(NSString *)address {
     sockaddr_union serverAddr;
-    [self parseV4Address:address into:&serverAddr.any];
+    if (![self parseAddress:address into:&serverAddr.any])
+        return nil;
 
     int clientSocket = [self newSocket:serverAddr.sa_family];
     if (clientSocket < 0)
@@ -122,6 +151,96 @@ typedef union {
     return [[self alloc] initSocket:clientSocket];
 }
 
++ (instancetype)connectTo:(NSString *)address timeout:(NSTimeInterval)timeout {
+    return [self connectToFirstOf:@[address] timeout:timeout winner:NULL];
+}
+
+/// Race non-blocking connects to a number of candidate server addresses
+/// returning a connection to whichever completes first within the timeout.
+/// @param addresses Candidates in any of the formats parseAddress: accepts.
+/// @param timeout Maximum time to wait for any of the connects to complete.
+/// @param winner Optionally returns the address that connected.
++ (instancetype)connectToFirstOf:(NSArray<NSString *> *)addresses
+                         timeout:(NSTimeInterval)timeout
+                          winner:(NSString **)winner {
+    std::vector<struct pollfd> pending;
+    NSMutableArray<NSString *> *pendingAddresses = [NSMutableArray new];
+    NSString *connectedAddress = nil;
+    int connectedSocket = -1;
+
+    for (NSString *address in addresses) {
+        sockaddr_union serverAddr;
+        if (![self parseAddress:address into:&serverAddr.any])
+            continue;
+
+        int clientSocket = [self newSocket:serverAddr.sa_family];
+        if (clientSocket < 0)
+            continue;
+
+        if (fcntl(clientSocket, F_SETFL,
+                  fcntl(clientSocket, F_GETFL) | O_NONBLOCK) < 0)
+            [self error:@"Could not set O_NONBLOCK: %s"];
+        else if (connect(clientSocket, &serverAddr.addr, serverAddr.sa_len) == 0) {
+            connectedSocket = clientSocket;
+            connectedAddress = address;
+            break;
+        }
+        else if (errno == EINPROGRESS) {
+            pending.push_back({clientSocket, POLLOUT, 0});
+            [pendingAddresses addObject:address];
+            continue;
+        }
+        else
+            SLog(@"Could not connect to %@: %s", address, strerror(errno));
+        close(clientSocket);
+    }
+
+    NSTimeInterval deadline = [NSDate timeIntervalSinceReferenceDate] + timeout;
+    while (connectedSocket < 0 && !pending.empty()) {
+        NSTimeInterval remaining = deadline - [NSDate timeIntervalSinceReferenceDate];
+        if (remaining <= 0)
+            break;
+
+        int ready = poll(pending.data(), (nfds_t)pending.size(),
+                         (int)ceil(remaining * 1000.));
+        if (ready < 0 && errno != EINTR) {
+            [self error:@"Could not poll connecting sockets: %s"];
+            break;
+        }
+
+        for (size_t i = pending.size(); ready > 0 && i-- > 0;) {
+            if (!pending[i].revents)
+                continue;
+            int error = 0;
+            socklen_t errlen = sizeof error;
+            if (connectedSocket < 0 &&
+                getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &errlen) == 0 &&
+                error == 0 && !(pending[i].revents & (POLLERR|POLLHUP))) {
+                connectedSocket = pending[i].fd;
+                connectedAddress = pendingAddresses[i];
+            }
+            else {
+                SLog(@"Could not connect to %@: %s", pendingAddresses[i], strerror(error));
+                close(pending[i].fd);
+            }
+            pending.erase(pending.begin() + i);
+            [pendingAddresses removeObjectAtIndex:i];
+        }
+    }
+
+    // abandon any connects that lost the race
+    for (struct pollfd &loser : pending)
+        close(loser.fd);
+
+    if (connectedSocket < 0)
+        return nil;
+
+    fcntl(connectedSocket, F_SETFL, fcntl(connectedSocket, F_GETFL) & ~O_NONBLOCK);
+    if (winner)
+        *winner = connectedAddress;
+    return [[self alloc] initSocket:connectedSocket];
+}
+
 + (int)newSocket:(sa_family_t)addressFamily {
     int newSocket, yes = 1;
     if ((newSocket = socket(addressFamily, SOCK_STREAM, 0)) < 0)
@@ -130,7 +249,8 @@ typedef union {
         [self error:@"Could not set SO_REUSEADDR: %s"];
     else if (setsockopt(newSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof yes) < 0)
         [self error:@"Could not set SO_NOSIGPIPE: %s"];
-    else if (setsockopt(newSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) < 0)
+    else if (addressFamily == AF_INET &&
+             setsockopt(newSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) < 0)
         [self error:@"Could not set TCP_NODELAY: %s"];
     else if (fcntl(newSocket, F_SETFD, FD_CLOEXEC) < 0)
         [self error:@"Could not set FD_CLOEXEC: %s"];
@@ -139,6 +259,29 @@ typedef union {
     return -1;
 }
 
+/**
+ * Addresses starting with "/" are the path of a Unix domain socket,
+ * anything else is an internet address parsed by parseV4Address:.
+ */
++ (BOOL)parseAddress:(NSString *)address into:(struct sockaddr_storage *)serverAddr {
+    if (![address hasPrefix:@"/"])
+        return [self parseV4Address:address into:serverAddr];
+
+    struct sockaddr_un *localAddr = (struct sockaddr_un *)serverAddr;
+    bzero(localAddr, sizeof *localAddr);
+
+    const char *path = address.fileSystemRepresentation;
+    if (strlen(path) >= sizeof localAddr->sun_path) {
+        NSLog(@"%@: Socket path too long: %s", self, path);
+        return FALSE;
+    }
+
+    localAddr->sun_family = AF_UNIX;
+    strcpy(localAddr->sun_path, path);
+    localAddr->sun_len = SUN_LEN(localAddr);
+    return TRUE;
+}
+
 /**
  * Available formats
  * @"<host>[:<port>]"
@@ -277,6 +420,71 @@ typedef ssize_t (*io_func)(int, void *, size_t);
     close(clientSocket);
 }
 
+#if DEBUG
+/// Average time for an int to make a round trip to an echo
+/// thread over a freshly opened connection to the address.
+/// @param address Unix domain socket path or address to bind.
+/// @param count Number of round trips to time.
+/// @return Seconds per round trip or -1 on error.
++ (NSTimeInterval)roundTripTime:(NSString *)address count:(int)count {
+    sockaddr_union serverAddr;
+    socklen_t addrLen = sizeof serverAddr;
+    if (![self parseAddress:address into:&serverAddr.any])
+        return -1;
+
+    int serverSocket = [self newSocket:serverAddr.sa_family];
+    if (serverSocket < 0)
+        return -1;
+    if (serverAddr.sa_family == AF_UNIX)
+        unlink(serverAddr.local.sun_path);
+    if (bind(serverSocket, &serverAddr.addr, serverAddr.sa_len) < 0 ||
+        listen(serverSocket, 1) < 0 || // recover any port allocated
+        getsockname(serverSocket, &serverAddr.addr, &addrLen) < 0) {
+        [self error:@"Could not listen for benchmark: %s"];
+        close(serverSocket);
+        return -1;
+    }
+
+    int clientSocket = [self newSocket:serverAddr.sa_family];
+    if (clientSocket < 0 ||
+        connect(clientSocket, &serverAddr.addr, serverAddr.sa_len) < 0) {
+        [self error:@"Could not connect for benchmark: %s"];
+        close(serverSocket);
+        close(clientSocket);
+        return -1;
+    }
+
+    int echoSocket = accept(serverSocket, NULL, NULL);
+    close(serverSocket);
+    if (serverAddr.sa_family == AF_UNIX)
+        unlink(serverAddr.local.sun_path);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+        int32_t ping;
+        while (read(echoSocket, &ping, sizeof ping) == sizeof ping &&
+               write(echoSocket, &ping, sizeof ping) == sizeof ping)
+            ;
+        close(echoSocket);
+    });
+
+    SimpleSocket *client = [[SimpleSocket alloc] initSocket:clientSocket];
+    NSTimeInterval started = [NSDate timeIntervalSinceReferenceDate];
+    for (int i=0; i<count; i++)
+        if (![client writeInt:i] || [client readInt] != i)
+            return -1;
+    return ([NSDate timeIntervalSinceReferenceDate] - started) / count;
+}
+
+/// Log round trip latency of Unix domain sockets c.f. loopback TCP.
++ (void)benchmarkTransports:(int)count {
+    NSString *path = [NSTemporaryDirectory()
+                      stringByAppendingPathComponent:@"benchmark.socket"];
+    NSTimeInterval local = [self roundTripTime:path count:count],
+        loopback = [self roundTripTime:@"127.0.0.1:" count:count];
+    NSLog(@"%@: Round trip AF_UNIX %.1fµs, TCP loopback %.1fµs (x%d)",
+          self, local * 1e6, loopback * 1e6, count);
+}
+#endif
+
 /// Hash used to differentiate HotReloading users on network.
 /// Derived from path to source file in project's DerivedData.
 + (int)multicastHash {
@@ -371,8 +579,10 @@ struct multicast_socket_packet {
 /// @param multicast Multicast IP address to use.
 /// @param port Port number as string.
 /// @param format Format for connecting message.
+/// @param timeout Deadline for a reply or 0.0 to wait indefinitely.
 + (NSString *)getMulticastService:(const char *)multicast
-    port:(const char *)port message:(const char *)format {
+    port:(const char *)port message:(const char *)format
+                          timeout:(NSTimeInterval)timeout {
     #ifdef DEVELOPER_HOST
     if (isdigit(DEVELOPER_HOST[0]))
         return @DEVELOPER_HOST;
@@ -423,11 +633,33 @@ struct multicast_socket_packet {
             [self error:@"Could not send broadcast ping: %s"];
     }];
 
-    socklen_t addrlen = sizeof addr;
-    while (recvfrom(multicastSocket, &msgbuf, sizeof msgbuf, 0,
-                    (struct sockaddr *)&addr, &addrlen) < sizeof msgbuf) {
-        [self error:@"%s: Error receiving from broadcast: %s"];
-        sleep(1);
+    NSTimeInterval deadline = [NSDate timeIntervalSinceReferenceDate] + timeout;
+    while (TRUE) {
+        if (timeout > 0.) {
+            NSTimeInterval remaining = deadline - [NSDate timeIntervalSinceReferenceDate];
+            if (remaining <= 0.) {
+                close(multicastSocket);
+                return nil;
+            }
+            struct timeval tv = {(time_t)remaining,
+                (suseconds_t)((remaining - floor(remaining)) * 1e6)};
+            if (tv.tv_sec == 0 && tv.tv_usec == 0)
+                tv.tv_usec = 1; // {0,0} would disable the timeout
+            setsockopt(multicastSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        }
+
+        socklen_t addrlen = sizeof addr;
+        ssize_t received = recvfrom(multicastSocket, &msgbuf, sizeof msgbuf, 0,
+                                    (struct sockaddr *)&addr, &addrlen);
+        if (received == (ssize_t)sizeof msgbuf)
+            break;
+        if (received < 0 && (errno == EAGAIN || errno == EINTR))
+            continue; // deadline checked above
+        [self error:@"Error receiving from broadcast: %s"];
+        if (timeout > 0.)
+            usleep(100*1000);
+        else
+            sleep(1);
     }
 
     const char *ipaddr = inet_ntoa(addr.sin_addr);
@@ -436,5 +668,11 @@ struct multicast_socket_packet {
     return [NSString stringWithUTF8String:ipaddr];
 }
 
++ (NSString *)getMulticastService:(const char *)multicast
+    port:(const char *)port message:(const char *)format {
+    return [self getMulticastService:multicast port:port
+                             message:format timeout:0.];
+}
+
 @end
 #endif
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 06/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/include/InjectionClient.h#68 $
+//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/include/InjectionClient.h#74 $
 //
 //  Shared definitions between server and client.
 //
@@ -20,17 +20,20 @@
 #endif
 
 #define HOTRELOADING_PORT ":8899"
+#define HOTRELOADING_SOCKET "/tmp/HotReloading.socket"
 #define HOTRELOADING_SALT 2122172543
 #define HOTRELOADING_MULTICAST "239.255.255.239"
 
 #ifdef INJECTION_III_APP
 #define INJECTION_ADDRESS ":8898"
+#define INJECTION_SOCKET "/tmp/InjectionIII.socket"
 #import "../../../../InjectionIII/InjectionIIISalt.h"
 #define INJECTION_KEY @"bvijkijyhbtrbrebzjbbzcfbbvvq"
 #define APP_NAME "InjectionIII"
 #define APP_PREFIX "💉 "
 #else
 #define INJECTION_ADDRESS HOTRELOADING_PORT
+#define INJECTION_SOCKET HOTRELOADING_SOCKET
 #define INJECTION_SALT HOTRELOADING_SALT
 extern NSString *INJECTION_KEY;
 #define APP_NAME "HotReloading"
@@ -73,6 +76,9 @@ extern NSString *INJECTION_KEY;
 #define INJECTION_TRACE "INJECTION_TRACE"
 #define INJECTION_BAZEL "INJECTION_BAZEL"
 #define INJECTION_DEBUG "INJECTION_DEBUG"
+#define INJECTION_NOUNIX "INJECTION_NOUNIX"
+#define INJECTION_BENCHMARK "INJECTION_BENCHMARK"
+#define INJECTION_VACCINE_TARGETED "INJECTION_VACCINE_TARGETED"
 #define INJECTION_BUNDLE_NOTIFICATION "INJECTION_BUNDLE_NOTIFICATION"
 #define INJECTION_METRICS_NOTIFICATION "INJECTION_METRICS_NOTIFICATION"
 
@@ -137,6 +143,8 @@ typedef NS_ENUM(int, InjectionCommand) {
     InjectionSetXcodeDev,
     InjectionAppVersion,
     InjectionProfileUI,
+    InjectionFootprint,
+    InjectionTag,
 
     InjectionInvalid = 1000,
 
@@ -160,6 +168,8 @@ typedef NS_ENUM(int, InjectionResponse) {
     InjectionBuildCache,
     InjectionDerivedData,
     InjectionPlatform,
+    InjectionTagged,
+    InjectionLatencyStats,
 
     InjectionExit = ~0
 };
@@ -174,6 +184,9 @@ extern int unhide_object(const char *object_file, const char *framework, FILE *l
                          NSMutableArray<NSString *> *descriptor_refs);
 extern void unhide_reset(void);
 
+// defined in ClientBoot.mm
+extern NSString *executable_uuid(void);
+
 #if !TARGET_IPHONE_SIMULATOR
 extern void reverse_symbolics(const void *image);
 #endif
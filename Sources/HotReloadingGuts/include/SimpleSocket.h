@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 06/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/include/SimpleSocket.h#16 $
+//  $Id: //depot/HotReloading/Sources/HotReloadingGuts/include/SimpleSocket.h#20 $
 //
 
 #import <Foundation/Foundation.h>
@@ -23,12 +23,27 @@
 + (int)error:(NSString *_Nonnull)message;
 
 + (instancetype _Nullable)connectTo:(NSString *_Nonnull)address;
++ (instancetype _Nullable)connectTo:(NSString *_Nonnull)address
+                            timeout:(NSTimeInterval)timeout;
++ (instancetype _Nullable)connectToFirstOf:(NSArray<NSString *> *_Nonnull)addresses
+                                   timeout:(NSTimeInterval)timeout
+                                    winner:(NSString *_Nullable *_Nullable)winner;
++ (BOOL)parseAddress:(NSString *_Nonnull)address into:(struct sockaddr_storage *_Nonnull)serverAddr;
 + (BOOL)parseV4Address:(NSString *_Nonnull)address into:(struct sockaddr_storage *_Nonnull)serverAddr;
 
 + (void)multicastServe:(const char *_Nonnull)multicast port:(const char *_Nonnull)port;
 + (NSString *_Nonnull)getMulticastService:(const char *_Nonnull)multicast
                                      port:(const char *_Nonnull)port
                                   message:(const char *_Nonnull)format;
++ (NSString *_Nullable)getMulticastService:(const char *_Nonnull)multicast
+                                      port:(const char *_Nonnull)port
+                                   message:(const char *_Nonnull)format
+                                   timeout:(NSTimeInterval)timeout;
+
+#if DEBUG // benchmarking only
++ (NSTimeInterval)roundTripTime:(NSString *_Nonnull)address count:(int)count;
++ (void)benchmarkTransports:(int)count;
+#endif
 
 - (instancetype _Nonnull)initSocket:(int)socket;
 
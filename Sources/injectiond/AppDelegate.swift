@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 06/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/injectiond/AppDelegate.swift#82 $
+//  $Id: //depot/HotReloading/Sources/injectiond/AppDelegate.swift#84 $
 //
 
 import Cocoa
@@ -118,6 +118,7 @@ class AppDelegate : NSObject, NSApplicationDelegate {
         } else if let platform = getenv("PLATFORM_NAME"),
            strcmp(platform, "iphonesimulator") == 0 {
             DeviceServer.startServer(HOTRELOADING_PORT)
+            DeviceServer.startServer(HOTRELOADING_SOCKET)
         } else if let unlock = defaults.string(forKey: UserDefaultsUnlock) {
             let deviceInform = "deviceInform"
             var openPort = ""
@@ -144,10 +145,21 @@ class AppDelegate : NSObject, NSApplicationDelegate {
                                             port: HOTRELOADING_PORT)
             }
             DeviceServer.startServer(openPort+HOTRELOADING_PORT)
+            DeviceServer.startServer(HOTRELOADING_SOCKET)
         }
 
         #if !SWIFT_PACKAGE
         InjectionServer.startServer(INJECTION_ADDRESS)
+        if !isSandboxed { // can't bind in /tmp
+            InjectionServer.startServer(INJECTION_SOCKET)
+        }
+        #endif
+        #if DEBUG
+        if getenv(INJECTION_BENCHMARK) != nil {
+            DispatchQueue.global().async {
+                SimpleSocket.benchmarkTransports(10_000)
+            }
+        }
         #endif
 
         defaultsMap = [
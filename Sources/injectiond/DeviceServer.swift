@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 13/01/2022.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/injectiond/DeviceServer.swift#35 $
+//  $Id: //depot/HotReloading/Sources/injectiond/DeviceServer.swift#38 $
 //
 
 import Foundation
@@ -64,7 +64,21 @@ class DeviceServer: InjectionServer {
         }
     }
 
-    override func recompileAndInject(source: String) {
+    override var injectionGroup: String {
+        // pseudo-injected images are linked for this client's slide
+        if let slide = scratchPointer {
+            return super.injectionGroup+"|\(slide)"
+        }
+        return super.injectionGroup
+    }
+
+    override var canSpeculate: Bool {
+        // pseudo-injection has its own build path
+        return scratchPointer == nil
+    }
+
+    override func recompileAndInject(source: String, group: [InjectionServer],
+                                     results: InjectionResults?) {
         appDelegate.setMenuIcon(.busy)
         lastSource = source
         if let slide = self.scratchPointer {
@@ -94,6 +108,7 @@ class DeviceServer: InjectionServer {
                     if let objcClasses = self.objcClassRefs as? [String],
                        let descriptors = self.descriptorRefs as? [String],
                        let data = try? NSData(contentsOfFile: "\(dylib).dylib") as Data {
+                        results?.completed(by: self, error: nil)
                         commandQueue.async {
                             self.writeCommand(InjectionCommand.objcClassRefs.rawValue,
                                               with: objcClasses.joined(separator: ","))
@@ -109,24 +124,33 @@ class DeviceServer: InjectionServer {
                 } catch {
                     NSLog("\(error)")
                 }
+                results?.completed(by: self, error: "Build failed")
             }
         } else { // You can load a dylib on device after all...
-            super.recompileAndInject(source: source)
+            super.recompileAndInject(source: source,
+                                     group: group, results: results)
         }
     }
 
-    override func inject(dylib: String) {
+    override func inject(dylib: String, tag: String? = nil) {
         if isLocalClient {
-            return super.inject(dylib: dylib)
+            return super.inject(dylib: dylib, tag: tag)
         }
         if let data = NSData(contentsOfFile: "\(dylib).dylib") {
             commandQueue.sync {
+                if let tag = tag {
+                    _ = writeCommand(InjectionCommand.tag.rawValue, with: tag)
+                }
                 write(InjectionCommand.copy.rawValue)
                 write(data as Data)
                 appDelegate.setMenuIcon(.ok)
             }
         } else {
             sendCommand(.log, with: "\(APP_PREFIX)Error reading \(dylib).dylib")
+            if let tag = tag, let results = connectionsQueue.sync(execute: {
+                awaiting.removeValue(forKey: tag) }) {
+                results.completed(by: self, error: "Dylib not readable")
+            }
         }
     }
 }
@@ -5,7 +5,7 @@
 //  Created by User on 20/10/2020.
 //  Copyright © 2020 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/injectiond/Experimental.swift#39 $
+//  $Id: //depot/HotReloading/Sources/injectiond/Experimental.swift#40 $
 //
 
 import Cocoa
@@ -51,6 +51,10 @@ extension AppDelegate {
         lastConnection?.sendCommand(.counts, with: nil)
     }
 
+    @IBAction func footprint(_ sender: NSMenuItem) {
+        lastConnection?.sendCommand(.footprint, with: nil)
+    }
+
     func fileReorder(signatures: [String]) {
         var projectEncoding: String.Encoding = .utf8
         let projectURL = selectedProject.flatMap {
@@ -5,7 +5,7 @@
 //  Created by John Holdsworth on 06/11/2017.
 //  Copyright © 2017 John Holdsworth. All rights reserved.
 //
-//  $Id: //depot/HotReloading/Sources/injectiond/InjectionServer.swift#73 $
+//  $Id: //depot/HotReloading/Sources/injectiond/InjectionServer.swift#85 $
 //
 
 import Cocoa
@@ -17,6 +17,7 @@ import XprobeUI
 
 let commandQueue = DispatchQueue(label: "InjectionCommand")
 let compileQueue = DispatchQueue(label: "InjectionCompile")
+let connectionsQueue = DispatchQueue(label: "InjectionConnections")
 
 var projectInjected = [String: [String: TimeInterval]]()
 let MIN_INJECTION_INTERVAL = 1.0
@@ -25,7 +26,17 @@ public class InjectionServer: SimpleSocket {
     // InjectionNext integration
     static var clientQueue: DispatchQueue { commandQueue }
     static var currentClient: InjectionServer? { appDelegate.lastConnection }
-    static var currentClients: [InjectionServer?] { [currentClient] }
+    static var currentClients: [InjectionServer?] {
+        connectionsQueue.sync { connections } }
+    /// Clients in order of connection. The first processes file changes.
+    static var connections = [InjectionServer]()
+    static var coordinator: InjectionServer? { currentClients.first ?? nil }
+    /// Builds for clients that share a tmp directory can't overlap.
+    static var buildQueues = [String: DispatchQueue]()
+    /// Files modified but not yet injected (main thread)
+    static var pending = [String]()
+    /// Builds started on save in manual mode by source|group
+    static var speculations = [String: SpeculativeBuild]()
     var injectionNumber = 100
     var exports = [String: [String]]()
     var platform = "iPhoneSimulator"
@@ -35,11 +46,46 @@ public class InjectionServer: SimpleSocket {
     var fileChangeHandler: ((_ changed: NSArray, _ ideProcPath:String) -> Void)!
     var fileWatchers = [FileWatcher]()
     var pause: TimeInterval = 0.0
-    var pending = [String]()
     var builder = UnhidingEval()
     var lastIdeProcPath = ""
     let objcClassRefs = NSMutableArray()
     let descriptorRefs = NSMutableArray()
+    /// Fan-outs waiting on a tagged .complete or .error by tag
+    var awaiting = [String: InjectionResults]()
+    static var resultTags = 0
+    /// Tag of the .complete or .error about to be received
+    var taggedResult: String?
+    /// Errors of a speculative build kept from the client until
+    /// an injection is requested, nil when not speculating
+    var heldErrors: [String]?
+
+    /// Clients in the same group can load the same dylib so
+    /// a source needs only be compiled once for all of them.
+    /// Dylibs find frameworks relative to the executable and are
+    /// copied into each client's tmpDir so only the toolchain,
+    /// SDK (from the build cache) and architecture are in the key.
+    var injectionGroup: String {
+        return [platform, arch, builder.buildCacheFile,
+                builder.xcodeDev].joined(separator: "|")
+    }
+    /// Count of dylibs copied from another client's tmpDir
+    static var dylibCopies = 0
+
+    /// Whether a dylib can be built for this client before it is asked for
+    var canSpeculate: Bool { return true }
+
+    var buildQueue: DispatchQueue {
+        return connectionsQueue.sync {
+            let tmpDir = builder.tmpDir
+            if let queue = Self.buildQueues[tmpDir] {
+                return queue
+            }
+            let queue = Self.buildQueues.isEmpty ? compileQueue :
+                DispatchQueue(label: "InjectionCompile \(Self.buildQueues.count)")
+            Self.buildQueues[tmpDir] = queue
+            return queue
+        }
+    }
 
     open func log(_ msg: String) {
         NSLog("\(APP_PREFIX)\(APP_NAME) \(msg)")
@@ -124,8 +170,12 @@ public class InjectionServer: SimpleSocket {
         builder.evalError = {
             (message: String) in
             self.log("evalError: \(message)")
-            self.sendCommand(.log, with:
-                (message.hasPrefix("Compiling") ?"":"⚠️ ")+message)
+            let line = (message.hasPrefix("Compiling") ?"":"⚠️ ")+message
+            if self.heldErrors != nil {
+                self.heldErrors?.append(line)
+            } else if !self.builder.isCancelled {
+                self.sendCommand(.log, with: line)
+            }
             return NSError(domain:"SwiftEval", code:-1,
                            userInfo:[NSLocalizedDescriptionKey: message])
         }
@@ -159,7 +209,6 @@ public class InjectionServer: SimpleSocket {
 
         appDelegate.setMenuIcon(.ok)
         appDelegate.lastConnection = self
-        pending = []
 
         var lastInjected = projectInjected[projectFile]
         if lastInjected == nil {
@@ -168,6 +217,21 @@ public class InjectionServer: SimpleSocket {
         }
 
         guard let executable = readString() else { return }
+        connectionsQueue.sync {
+            Self.connections.append(self)
+        }
+        defer {
+            connectionsQueue.sync {
+                Self.connections.removeAll(where: { $0 === self })
+            }
+            // no one left to load builds for this client's group
+            Self.discardSpeculations(where: { build in
+                !Self.connections.contains(where: {
+                    $0.injectionGroup == build.group }) })
+            let awaited = connectionsQueue.sync { awaiting }
+            awaited.values.forEach {
+                $0.completed(by: self, error: "Disconnected") }
+        }
         if appDelegate.defaults.bool(forKey: UserDefaultsReplay) &&  
             appDelegate.enableWatcher.state == .on {
             let mtime = {
@@ -187,48 +251,58 @@ public class InjectionServer: SimpleSocket {
         builder.createUnhider(executable: executable,
                               objcClassRefs, descriptorRefs)
 
-        var testCache = [String: [String]]()
+        let testIndex = {
+            TestIndex.forProject(root: appDelegate.watchedDirectories.first ??
+                (projectFile as NSString).deletingLastPathComponent)
+        }
+        if UserDefaults.standard.bool(forKey: UserDefaultsTDDEnabled) {
+            _ = testIndex() // start indexing in the background
+        }
 
         fileChangeHandler = {
             (changed: NSArray, ideProcPath: String) in
+            // every client watches, only one need act
+            guard Self.coordinator === self else { return }
             var changed = changed as! [String]
 
+            TestIndex.current?.update(changed: changed)
             if UserDefaults.standard.bool(forKey: UserDefaultsTDDEnabled) {
+                let index = testIndex()
                 for injectedFile in changed {
-                    var matchedTests = testCache[injectedFile]
-                    if matchedTests == nil {
-                        matchedTests = Self.searchForTestWithFile(injectedFile,
-                              projectRoot: appDelegate
-                                .watchedDirectories.first ??
-                              (projectFile as NSString)
-                                .deletingLastPathComponent,
-                            fileManager: FileManager.default)
-                        testCache[injectedFile] = matchedTests
-                    }
-
-                    changed += matchedTests!
+                    changed += index.tests(for: injectedFile)
                 }
             }
 
             let now = NSDate.timeIntervalSinceReferenceDate
             let automatic = appDelegate.enableWatcher.state == .on
+            let clients = Self.currentClients.compactMap { $0 }
+            let pause = clients.map { $0.pause }.max() ?? 0.0
             for swiftSource in changed {
-                if !self.pending.contains(swiftSource) {
-                    if (now > (lastInjected?[swiftSource] ?? 0.0) + MIN_INJECTION_INTERVAL && now > self.pause) {
+                if !Self.pending.contains(swiftSource) {
+                    if (now > (lastInjected?[swiftSource] ?? 0.0) + MIN_INJECTION_INTERVAL && now > pause) {
                         lastInjected![swiftSource] = now
                         projectInjected[projectFile] = lastInjected!
-                        self.pending.append(swiftSource)
+                        Self.pending.append(swiftSource)
                         if !automatic {
                             let file = (swiftSource as NSString).lastPathComponent
-                            self.sendCommand(.log,
-                                with:"'\(file)' changed, type ctrl-= to inject")
+                            for client in clients {
+                                client.sendCommand(.log,
+                                    with:"'\(file)' changed, type ctrl-= to inject")
+                            }
+                            Self.speculate(source: swiftSource)
                         }
                     }
+                } else if !automatic { // saved again, rebuild
+                    Self.speculate(source: swiftSource)
                 }
             }
-            self.lastIdeProcPath = ideProcPath
-            self.builder.lastIdeProcPath = ideProcPath
+            for client in clients {
+                client.lastIdeProcPath = ideProcPath
+                client.builder.lastIdeProcPath = ideProcPath
+            }
             if (automatic) {
+                // builds from manual mode would be out of date
+                Self.discardSpeculations(where: { $0.loadInto == nil })
                 self.injectPending()
             }
         }
@@ -280,7 +354,10 @@ public class InjectionServer: SimpleSocket {
                                           menuTitle: "Trace SysInternal")
                 appDelegate.setFrameworks(readString() ?? "",
                                           menuTitle: "Trace Package")
+            case .tagged:
+                taggedResult = readString()
             case .complete:
+                completed(error: nil)
                 appDelegate.setMenuIcon(.ok)
                 if appDelegate.frontItem.state == .on {
                     print(executable)
@@ -315,6 +392,16 @@ public class InjectionServer: SimpleSocket {
                     break
                 }
                 sendCommand(.signed, with: signer(readString() ?? "") ? "1": "0")
+            case .latencyStats:
+                let path = NSTemporaryDirectory() + (executable as NSString)
+                    .lastPathComponent + "_InjectionStats.json"
+                do {
+                    try readString()?.write(toFile: path,
+                                            atomically: true, encoding: .utf8)
+                    sendCommand(.log, with: "\(APP_PREFIX)Latency stats exported to \(path)")
+                } catch {
+                    log("⚠️ Could not export stats to \(path): \(error)")
+                }
             case .callOrderList:
                 if let calls = readString()?
                     .components(separatedBy: CALLORDER_DELIMITER) {
@@ -322,8 +409,10 @@ public class InjectionServer: SimpleSocket {
                 }
                 break
             case .error:
+                let error = readString() ?? "Uknown"
+                completed(error: error)
                 appDelegate.setMenuIcon(.error)
-                log("Injection error: \(readString() ?? "Uknown")")
+                log("Injection error: \(error)")
             case .legacyUnhide:
                 builder.legacyUnhide = readString() == "1"
             case .forceUnhide:
@@ -352,8 +441,141 @@ public class InjectionServer: SimpleSocket {
             }
     }
 
+    /// Compile once for each group of connected clients that can
+    /// load the same dylib, in parallel across groups, then load
+    /// the result into all the clients of each group.
+    static func fanOut(source: String) {
+        let clients = currentClients.compactMap { $0 }
+        var groups = [String: [InjectionServer]]()
+        for client in clients {
+            groups[client.injectionGroup, default: []].append(client)
+        }
+        let results = clients.count > 1 ? InjectionResults(source: source,
+            clients: clients.count, builds: groups.count) : nil
+        for (key, group) in groups where !group[0].loadSpeculation(
+            key: source+"|"+key, group: group, results: results) {
+            group[0].recompileAndInject(source: source,
+                                        group: group, results: results)
+        }
+    }
+
+    /// In manual mode, build a saved source for each group of clients in
+    /// the background so injectPending() need only load the dylib.
+    static func speculate(source: String) {
+        guard !appDelegate.isSandboxed &&
+            !source.hasSuffix(".storyboard") && !source.hasSuffix(".xib") else {
+            return
+        }
+        var groups = [String: InjectionServer]()
+        for client in currentClients.compactMap({ $0 })
+            where client.canSpeculate {
+            if groups[client.injectionGroup] == nil {
+                groups[client.injectionGroup] = client
+            }
+        }
+        for (key, client) in groups {
+            client.speculate(source: source, group: key)
+        }
+    }
+
+    /// Build superseding any earlier speculation for the same
+    /// source and group which is skipped if it has not started
+    /// and interrupted if it is still building.
+    func speculate(source: String, group: String) {
+        let key = source+"|"+group
+        let build = SpeculativeBuild(source: source, group: group)
+        connectionsQueue.sync {
+            if let older = Self.speculations[key], older.dylib == nil {
+                build.loadInto = older.loadInto // already requested
+                older.building?.cancel()
+            }
+            Self.speculations[key] = build
+        }
+        buildQueue.async {
+            guard connectionsQueue.sync(execute: { () -> Bool in
+                guard Self.speculations[key] === build else { return false }
+                build.building = self.builder
+                return true
+            }) else { return }
+            var dylib: String?
+            self.heldErrors = []
+            do {
+                dylib = try self.prepare(source: source)
+            } catch {
+                if !self.builder.isCancelled {
+                    NSLog("\(APP_PREFIX)Speculative build error: \(error)")
+                }
+            }
+            let errors = self.heldErrors ?? []
+            self.heldErrors = nil
+            let loadInto = connectionsQueue.sync {
+                () -> (group: [InjectionServer], results: InjectionResults?)? in
+                build.building = nil
+                self.builder.uncancel()
+                guard Self.speculations[key] === build else { return nil }
+                build.dylib = dylib ?? ""
+                build.errors = dylib == nil ? errors : []
+                if build.loadInto != nil {
+                    Self.speculations[key] = nil
+                }
+                return build.loadInto
+            }
+            if let loadInto = loadInto {
+                build.errors.forEach { self.sendCommand(.log, with: $0) }
+                self.load(dylib: dylib, source: source,
+                          group: loadInto.group, results: loadInto.results)
+            }
+        }
+    }
+
+    /// Remove speculations, interrupting those still building.
+    static func discardSpeculations(where discard: (SpeculativeBuild) -> Bool) {
+        connectionsQueue.sync {
+            for (key, build) in speculations where discard(build) {
+                build.building?.cancel()
+                speculations[key] = nil
+            }
+        }
+    }
+
+    /// Load the dylib of a speculative build into a group or have
+    /// it loaded when the build completes.
+    /// - Returns: false if there was no speculation to use.
+    func loadSpeculation(key: String, group: [InjectionServer],
+                         results: InjectionResults?) -> Bool {
+        guard let build: SpeculativeBuild = connectionsQueue.sync(execute: {
+            guard let build = Self.speculations[key] else { return nil }
+            if build.dylib == nil {
+                build.loadInto = (group, results)
+            } else {
+                Self.speculations[key] = nil
+            }
+            return build
+        }) else { return false }
+        for client in group {
+            client.sendCommand(.ideProcPath, with: client.lastIdeProcPath)
+        }
+        if let dylib = build.dylib {
+            build.errors.forEach { sendCommand(.log, with: $0) }
+            load(dylib: dylib.isEmpty ? nil : dylib, source: build.source,
+                 group: group, results: results)
+        } else {
+            appDelegate.setMenuIcon(.busy)
+        }
+        return true
+    }
+
     func recompileAndInject(source: String) {
-        sendCommand(.ideProcPath, with: lastIdeProcPath)
+        recompileAndInject(source: source, group: [self], results: nil)
+    }
+
+    /// Build using this client's builder and load into each client
+    /// of the group, which includes self.
+    func recompileAndInject(source: String, group: [InjectionServer],
+                            results: InjectionResults?) {
+        for client in group {
+            client.sendCommand(.ideProcPath, with: client.lastIdeProcPath)
+        }
         appDelegate.setMenuIcon(.busy)
         if appDelegate.isSandboxed ||
             source.hasSuffix(".storyboard") || source.hasSuffix(".xib") {
@@ -361,23 +583,68 @@ public class InjectionServer: SimpleSocket {
             try? source.write(toFile: "/tmp/injecting_storyboard.txt",
                               atomically: false, encoding: .utf8)
             #endif
-            sendCommand(.inject, with: source)
+            for client in group {
+                let tag = client.expect(results)
+                commandQueue.sync {
+                    if let tag = tag {
+                        _ = client.writeCommand(InjectionCommand.tag.rawValue, with: tag)
+                    }
+                    _ = client.writeCommand(InjectionCommand.inject.rawValue, with: source)
+                }
+            }
         } else {
-            compileQueue.async {
+            buildQueue.async {
+                var dylib: String?
                 do {
-                    let dylib = try self.prepare(source: source)
-                    self.sendCommand(.setXcodeDev, with: self.builder.xcodeDev)
-                    self.inject(dylib: dylib)
-                    return
+                    dylib = try self.prepare(source: source)
                 } catch {
                     NSLog("\(APP_PREFIX)Build error: \(error)")
                 }
-                appDelegate.setMenuIcon(.error)
-                self.builder.updateLongTermCache(remove: source)
+                self.load(dylib: dylib, source: source,
+                          group: group, results: results)
             }
         }
     }
 
+    /// Load a built dylib into each client of the group or report failure.
+    func load(dylib: String?, source: String, group: [InjectionServer],
+              results: InjectionResults?) {
+        guard let dylib = dylib else {
+            appDelegate.setMenuIcon(.error)
+            builder.updateLongTermCache(remove: source)
+            for client in group {
+                results?.completed(by: client, error: "Build failed")
+            }
+            return
+        }
+        for client in group {
+            client.sendCommand(.setXcodeDev, with: builder.xcodeDev)
+            client.inject(dylib: dylib, tag: client.expect(results))
+        }
+    }
+
+    /// Have a fan-out wait on the result of a load or inject.
+    /// - Returns: tag the client sends back before its result
+    func expect(_ results: InjectionResults?) -> String? {
+        guard let results = results else { return nil }
+        return connectionsQueue.sync {
+            Self.resultTags += 1
+            let tag = "\(Self.resultTags)"
+            awaiting[tag] = results
+            return tag
+        }
+    }
+
+    /// Only results the client tagged complete a fan-out.
+    func completed(error: String?) {
+        guard let tag = taggedResult else { return }
+        taggedResult = nil
+        let results = connectionsQueue.sync {
+            awaiting.removeValue(forKey: tag)
+        }
+        results?.completed(by: self, error: error)
+    }
+
     public func prepare(source: String) throws -> String {
         #if INJECTION_III_APP
         if source.hasSuffix(".swift") && !appDelegate.isSandboxed &&
@@ -395,8 +662,35 @@ public class InjectionServer: SimpleSocket {
                   classNameOrFile: source, extra: nil)
     }
 
-    public func inject(dylib: String) {
-        sendCommand(.load, with: dylib)
+    public func inject(dylib: String, tag: String? = nil) {
+        let dylib = local(dylib: dylib)
+        commandQueue.sync {
+            if let tag = tag {
+                _ = writeCommand(InjectionCommand.tag.rawValue, with: tag)
+            }
+            _ = writeCommand(InjectionCommand.load.rawValue, with: dylib)
+        }
+    }
+
+    /// Copy a dylib built by another client of the group into this
+    /// client's tmpDir, which a sandboxed app may be confined to.
+    /// - Returns: path of the copy without extension or the original
+    func local(dylib: String) -> String {
+        let tmpDir = builder.tmpDir
+        guard !dylib.hasPrefix(tmpDir+"/") else { return dylib }
+        let copy = connectionsQueue.sync { () -> String in
+            Self.dylibCopies += 1
+            return tmpDir+"/"+URL(fileURLWithPath: dylib)
+                .lastPathComponent+"_\(Self.dylibCopies)"
+        }
+        do {
+            try FileManager.default.copyItem(atPath: dylib+".dylib",
+                                             toPath: copy+".dylib")
+            return copy
+        } catch {
+            log("Could not copy \(dylib).dylib to \(tmpDir): \(error)")
+            return dylib
+        }
     }
 
     public func watchDirectory(_ directory: String) {
@@ -406,10 +700,10 @@ public class InjectionServer: SimpleSocket {
     }
 
     @objc public func injectPending() {
-        for swiftSource in pending {
-            recompileAndInject(source: swiftSource)
+        for swiftSource in Self.pending {
+            Self.fanOut(source: swiftSource)
         }
-        pending.removeAll()
+        Self.pending.removeAll()
     }
 
     @objc public func setProject(_ projectFile: String) {
@@ -441,60 +735,237 @@ public class InjectionServer: SimpleSocket {
         }
     }
 
-    class func searchForTestWithFile(_ injectedFile: String,
-            projectRoot: String, fileManager: FileManager) -> [String] {
-        var matchedTests = [String]()
-        let injectedFileName = URL(fileURLWithPath: injectedFile)
-            .deletingPathExtension().lastPathComponent
-        let projectUrl = URL(fileURLWithPath: projectRoot)
-        if let enumerator = fileManager.enumerator(at: projectUrl,
-                includingPropertiesForKeys: [URLResourceKey.nameKey,
-                                             URLResourceKey.isDirectoryKey],
-                options: .skipsHiddenFiles,
-                errorHandler: {
+    public class func urlEncode(string: String) -> String {
+        let unreserved = "-._~/?"
+        var allowed = CharacterSet.alphanumerics
+        allowed.insert(charactersIn: unreserved)
+        return string.addingPercentEncoding(withAllowedCharacters: allowed)!
+    }
+
+    deinit {
+        log("\(self).deinit()")
+    }
+}
+
+/// A build started on save in manual mode ahead of injectPending().
+class SpeculativeBuild {
+    let source: String
+    /// injectionGroup of the clients the build is for
+    let group: String
+    /// Path of the dylib without extension once built, "" if the build failed
+    var dylib: String?
+    /// Clients to load into when built if injectPending() came first
+    var loadInto: (group: [InjectionServer], results: InjectionResults?)?
+    /// Builder while the build is running, so it can be cancelled
+    var building: SwiftEval?
+    /// Errors of a failed build, shown when injection is requested
+    var errors = [String]()
+
+    init(source: String, group: String) {
+        self.source = source
+        self.group = group
+    }
+}
+
+/// Collects the outcome of injecting a source into several clients.
+class InjectionResults {
+    let source: String
+    let clients: Int
+    let builds: Int
+    let started = NSDate.timeIntervalSinceReferenceDate
+    var outstanding: Int
+    var failures = [String]()
+
+    init(source: String, clients: Int, builds: Int) {
+        self.source = source
+        self.clients = clients
+        self.builds = builds
+        outstanding = clients
+    }
+
+    func completed(by client: InjectionServer, error: String?) {
+        let failed: [String]? = connectionsQueue.sync {
+            if let error = error {
+                failures.append("\(client.platform)/\(client.arch): \(error)")
+            }
+            outstanding -= 1
+            return outstanding == 0 ? failures : nil
+        }
+        guard let failed = failed else { return }
+        let elapsed = NSDate.timeIntervalSinceReferenceDate - started
+        NSLog("\(APP_PREFIX)Injected \((source as NSString).lastPathComponent) " +
+              "into \(clients - failed.count)/\(clients) clients with " +
+              "\(builds) build(s) in \(Int(elapsed * 1000.0))ms" +
+              (failed.isEmpty ? "" : ", failed: " +
+                failed.joined(separator: ", ")))
+    }
+}
+
+/// Index of the test and spec sources of a project so TDD mode can find
+/// the tests of a changed file without walking the project each time.
+/// Built once in the background and kept current from file watcher events.
+class TestIndex {
+    /// Set from connection threads and read on the main thread
+    static let currentLock = NSLock()
+    private static var lastIndex: TestIndex?
+    static var current: TestIndex? {
+        currentLock.lock()
+        defer { currentLock.unlock() }
+        return lastIndex
+    }
+    static let indexQueue = DispatchQueue(label: "InjectionTests")
+
+    static func forProject(root: String) -> TestIndex {
+        currentLock.lock()
+        defer { currentLock.unlock() }
+        if let index = lastIndex, index.projectRoot == root {
+            return index
+        }
+        let index = TestIndex(projectRoot: root)
+        lastIndex = index
+        return index
+    }
+
+    let projectRoot: String
+    /// Guards the index, which is queried from the main thread
+    let lock = NSLock()
+    /// Whether the initial enumeration has completed
+    var built = false
+    /// Paths of test sources
+    var tests = Set<String>()
+    /// Paths of test sources by each run of words in their file name
+    var byToken = [String: Set<String>]()
+
+    init(projectRoot: String) {
+        self.projectRoot = projectRoot
+        Self.indexQueue.async {
+            self.build()
+        }
+    }
+
+    static let wordPattern = try! NSRegularExpression(
+        pattern: "[A-Z]+(?![a-z])|[A-Z]?[a-z]+|[0-9]+")
+
+    /// Lowercased words of a file's base name ("URLSessionTests"
+    /// is "url", "session", "tests").
+    static func words(of fileName: String) -> [String] {
+        let base = (fileName as NSString).deletingPathExtension as NSString
+        return wordPattern.matches(in: base as String,
+                                   range: NSMakeRange(0, base.length))
+            .map { base.substring(with: $0.range).lowercased() }
+    }
+
+    /// Every run of consecutive words so "MyViewControllerTests"
+    /// can be found by "ViewController" with a single lookup.
+    static func tokens(of fileName: String) -> Set<String> {
+        let words = Self.words(of: fileName)
+        var tokens = Set<String>()
+        for start in words.indices {
+            var token = ""
+            for word in words[start...] {
+                token += word
+                tokens.insert(token)
+            }
+        }
+        return tokens
+    }
+
+    static func isTest(_ fileName: String) -> Bool {
+        return fileName.hasSuffix(".swift") &&
+            (fileName.contains("Test") || fileName.contains("Spec."))
+    }
+
+    func build() {
+        let projectURL = URL(fileURLWithPath: projectRoot)
+        guard let enumerator = FileManager.default.enumerator(at: projectURL,
+                includingPropertiesForKeys: [.nameKey, .isDirectoryKey],
+                options: .skipsHiddenFiles, errorHandler: {
                     (url: URL, error: Error) -> Bool in
                     NSLog("[Error] \(error) (\(url))")
                     return false
-        }) {
-            for fileURL in enumerator {
-                var filename: AnyObject?
-                var isDirectory: AnyObject?
-                if let fileURL = fileURL as? NSURL {
-                    try! fileURL.getResourceValue(&filename, forKey:URLResourceKey.nameKey)
-                    try! fileURL.getResourceValue(&isDirectory, forKey:URLResourceKey.isDirectoryKey)
-
-                    if filename?.hasPrefix("_") == true &&
-                        isDirectory?.boolValue == true {
-                        enumerator.skipDescendants()
-                        continue
-                    }
-
-                    if isDirectory?.boolValue == false  &&
-                        filename?.pathExtension == ".swift",
-                        let lastPathComponent = filename?.lastPathComponent,
-                        lastPathComponent !=
-                            (injectedFile as NSString).lastPathComponent &&
-                        filename?.lowercased
-                            .contains(injectedFileName.lowercased()) == true &&
-                        (lastPathComponent.contains("Test") == true ||
-                         lastPathComponent.contains("Spec.") == true) {
-                        matchedTests.append(fileURL.path!)
-                    }
+                }) else {
+            lock.lock()
+            built = true
+            lock.unlock()
+            return
+        }
+        var found = [String]()
+        for case let fileURL as URL in enumerator {
+            guard let values = try? fileURL.resourceValues(
+                    forKeys: [.nameKey, .isDirectoryKey]),
+                  let filename = values.name else {
+                continue
+            }
+            if values.isDirectory == true {
+                if filename.hasPrefix("_") {
+                    enumerator.skipDescendants()
                 }
+            } else if Self.isTest(filename) {
+                found.append(fileURL.path)
             }
         }
+        lock.lock()
+        found.forEach { add(test: $0) }
+        built = true
+        lock.unlock()
+        NSLog("\(APP_PREFIX)Indexed \(found.count) test files under \(projectRoot)")
+    }
 
-        return matchedTests
+    func add(test path: String) {
+        guard tests.insert(path).inserted else { return }
+        for token in Self.tokens(of: (path as NSString).lastPathComponent) {
+            byToken[token, default: []].insert(path)
+        }
     }
 
-    public class func urlEncode(string: String) -> String {
-        let unreserved = "-._~/?"
-        var allowed = CharacterSet.alphanumerics
-        allowed.insert(charactersIn: unreserved)
-        return string.addingPercentEncoding(withAllowedCharacters: allowed)!
+    func remove(test path: String) {
+        guard tests.remove(path) != nil else { return }
+        for token in Self.tokens(of: (path as NSString).lastPathComponent) {
+            byToken[token]?.remove(path)
+            if byToken[token]?.isEmpty == true {
+                byToken[token] = nil
+            }
+        }
     }
 
-    deinit {
-        log("\(self).deinit()")
+    /// Excludes paths the initial enumeration would have skipped.
+    func indexable(_ path: String) -> Bool {
+        guard path.hasPrefix(projectRoot+"/") else { return false }
+        return !path.dropFirst(projectRoot.count+1)
+            .components(separatedBy: "/").dropLast()
+            .contains(where: { $0.hasPrefix(".") || $0.hasPrefix("_") }) &&
+            !(path as NSString).lastPathComponent.hasPrefix(".")
+    }
+
+    /// Record tests that have been added, renamed or removed.
+    func update(changed: [String]) {
+        Self.indexQueue.async {
+            for path in changed where self.indexable(path) &&
+                Self.isTest((path as NSString).lastPathComponent) {
+                let exists = FileManager.default.fileExists(atPath: path)
+                self.lock.lock()
+                if exists {
+                    self.add(test: path)
+                } else {
+                    self.remove(test: path)
+                }
+                self.lock.unlock()
+            }
+        }
+    }
+
+    /// Tests with file names containing the name of the injected file.
+    /// Never waits for the initial enumeration, finding none until then.
+    func tests(for injectedFile: String) -> [String] {
+        let injectedName = (injectedFile as NSString).lastPathComponent
+        let token = Self.words(of: injectedName).joined()
+        lock.lock()
+        defer { lock.unlock() }
+        guard built else {
+            NSLog("\(APP_PREFIX)Tests not yet indexed for \(injectedName)")
+            return []
+        }
+        return (byToken[token] ?? []).filter {
+            ($0 as NSString).lastPathComponent != injectedName }
     }
 }